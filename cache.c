@@ -0,0 +1,180 @@
+/*
+ * cache.c
+ * 
+ * This module keeps recently used EEPROM pages in SRAM.
+ */
+
+#include "cache.h"
+#include "i2c.h"
+#include <string.h>
+
+#define CACHE_NO_PAGE 0xFFFF
+
+/** @brief One cached EEPROM page */
+struct cache_page {
+	uint16_t page;    // page number, CACHE_NO_PAGE if unused
+	uint8_t dirty;    // data differs from the EEPROM
+	uint8_t used;     // value of cache_clock at the last access
+	uint8_t data[EEPROM_PAGE_SIZE];
+};
+
+static struct cache_page pages[CACHE_PAGES];
+
+/** @brief Counts the accesses, the least recently used page is evicted */
+static uint8_t cache_clock = 0;
+
+uint16_t cache_hits = 0;
+uint16_t cache_misses = 0;
+
+/** @brief Write a page back to the EEPROM if it was changed
+ * 
+ * A page the EEPROM did not get is dropped, later reads must not be
+ * served data that is not stored.
+ */
+static uint8_t cache_write_back(struct cache_page * page)
+{
+	uint8_t ret = TWI_SUCCESS;
+
+	if(page->dirty) {
+		ret = eeprom_write_bytes(page->page * EEPROM_PAGE_SIZE, page->data, EEPROM_PAGE_SIZE);
+		if(ret != TWI_SUCCESS) {
+			page->page = CACHE_NO_PAGE;
+		}
+		page->dirty = 0;
+	}
+
+	return ret;
+}
+
+/** @brief Find a page in the cache or make room for it
+ * 
+ * On a miss the least recently used page is written back and reused.
+ * 
+ * @param number Page number
+ * @param load 0 if the page will be overwritten completely
+ * @return the cached page, 0 on a bus error
+ */
+static struct cache_page * cache_get(uint16_t number, uint8_t load)
+{
+	struct cache_page * victim = &pages[0];
+
+	for(uint8_t i = 0; i < CACHE_PAGES; i++){
+		if(pages[i].page == number) {
+			cache_hits++;
+			pages[i].used = ++cache_clock;
+			return &pages[i];
+		}
+		// unused pages first, then the oldest one
+		if(victim->page != CACHE_NO_PAGE &&
+			(pages[i].page == CACHE_NO_PAGE ||
+			(uint8_t)(cache_clock - pages[i].used) > (uint8_t)(cache_clock - victim->used))) {
+			victim = &pages[i];
+		}
+	}
+
+	cache_misses++;
+	if(cache_write_back(victim) != TWI_SUCCESS) {
+		return 0;
+	}
+	victim->page = CACHE_NO_PAGE;
+	if(load && eeprom_read_bytes(number * EEPROM_PAGE_SIZE, victim->data, EEPROM_PAGE_SIZE) != TWI_SUCCESS) {
+		return 0;
+	}
+	victim->page = number;
+	victim->used = ++cache_clock;
+	return victim;
+}
+
+/** @brief Read bytes through the cache
+ * 
+ * @param addr EEPROM address
+ * @param values (out) read bytes
+ * @param size Number of bytes
+ * @return TWI_SUCCESS or the error of the bus
+ */
+uint8_t cache_read(uint16_t addr, uint8_t * values, uint16_t size)
+{
+	while(size) {
+		uint8_t offset = addr % EEPROM_PAGE_SIZE;
+		uint8_t count = EEPROM_PAGE_SIZE - offset;
+		if(count > size) {
+			count = size;
+		}
+
+		struct cache_page * page = cache_get(addr / EEPROM_PAGE_SIZE, 1);
+		if(!page) {
+			return TWI_ERROR;
+		}
+		memcpy(values, &page->data[offset], count);
+
+		addr += count;
+		values += count;
+		size -= count;
+	}
+
+	return TWI_SUCCESS;
+}
+
+/** @brief Write bytes into the cache
+ * 
+ * The bytes reach the EEPROM when their page is evicted or on cache_flush.
+ * 
+ * @param addr EEPROM address
+ * @param values Bytes to write
+ * @param size Number of bytes
+ * @return TWI_SUCCESS or the error of the bus
+ */
+uint8_t cache_write(uint16_t addr, uint8_t * values, uint16_t size)
+{
+	while(size) {
+		uint8_t offset = addr % EEPROM_PAGE_SIZE;
+		uint8_t count = EEPROM_PAGE_SIZE - offset;
+		if(count > size) {
+			count = size;
+		}
+
+		// a page that is overwritten completely does not have to be read
+		struct cache_page * page = cache_get(addr / EEPROM_PAGE_SIZE, count != EEPROM_PAGE_SIZE);
+		if(!page) {
+			return TWI_ERROR;
+		}
+		memcpy(&page->data[offset], values, count);
+		page->dirty = 1;
+
+		addr += count;
+		values += count;
+		size -= count;
+	}
+
+	return TWI_SUCCESS;
+}
+
+/** @brief Write all changed pages to the EEPROM
+ * 
+ * @return TWI_SUCCESS or the error of the bus
+ */
+uint8_t cache_flush()
+{
+	uint8_t ret = TWI_SUCCESS;
+
+	for(uint8_t i = 0; i < CACHE_PAGES; i++){
+		if(cache_write_back(&pages[i]) != TWI_SUCCESS) {
+			ret = TWI_ERROR;
+		}
+	}
+
+	return ret;
+}
+
+/** @brief Drop all pages without writing them back
+ * 
+ * Has to be called once before the cache is used (eeprom_init does),
+ * and when the EEPROM was changed around the cache.
+ */
+void cache_invalidate()
+{
+	for(uint8_t i = 0; i < CACHE_PAGES; i++){
+		pages[i].page = CACHE_NO_PAGE;
+		pages[i].dirty = 0;
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * cache.h
+ * 
+ * This module keeps recently used EEPROM pages in SRAM.
+ * 
+ * The directory is read again and again while browsing and looking up
+ * names. With a few pages held in SRAM most of these reads need no bus
+ * traffic, and writes to the same page are combined into one page write.
+ * Dirty pages are written back when they are evicted or on cache_flush.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+
+/** @brief Number of cached pages
+ * 
+ * Every page takes EEPROM_PAGE_SIZE + 4 bytes of SRAM. Compare
+ * cache_hits / cache_misses when changing it. Browsing walks through
+ * neighbouring entries, so a few pages go a long way.
+ */
+#define CACHE_PAGES 2
+
+// accesses served from SRAM / that had to load a page, since reset
+extern uint16_t cache_hits;
+extern uint16_t cache_misses;
+
+// all doc commens can be found in .c file
+
+uint8_t cache_read(uint16_t addr, uint8_t * values, uint16_t size);
+uint8_t cache_write(uint16_t addr, uint8_t * values, uint16_t size);
+uint8_t cache_flush();
+void cache_invalidate();
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,468 @@
+/*
+ * codec.c
+ * 
+ * This module compresses the IR timings for storage.
+ */
+
+#include "codec.h"
+#include <string.h>
+
+/** @brief Tolerance for clustering durations into one bin
+ * 
+ * A duration belongs to a bin if it is within 1/8 (+ 2 ticks for very short
+ * durations) of the bin's center. This is well within what IR receivers
+ * accept, so clustering does not change how a command is understood.
+ * It is also the largest error CODEC_SYMBOL may add to a timing.
+ */
+static uint8_t codec_in_tolerance(uint16_t value, uint16_t center)
+{
+	uint16_t diff = value > center ? value - center : center - value;
+	return diff <= center / 8 + 2;
+}
+
+/** @brief Index of the bin closest to value */
+static uint8_t codec_nearest_bin(uint16_t value, uint16_t * bins, uint8_t count)
+{
+	uint8_t nearest = 0;
+	uint16_t nearest_diff = 0xFFFF;
+
+	for(uint8_t bin = 0; bin < count; bin++){
+		uint16_t diff = value > bins[bin] ? value - bins[bin] : bins[bin] - value;
+		if(diff < nearest_diff){
+			nearest_diff = diff;
+			nearest = bin;
+		}
+	}
+
+	return nearest;
+}
+
+/** @brief Build the bins of the symbol codec
+ * 
+ * @param bins (out) centers of the bins
+ * @return number of bins, 0 if more than CODEC_MAX_BINS are needed or a
+ *         duration is too far from its bin's center
+ */
+static uint8_t codec_build_bins(uint16_t * ir, uint16_t edges, uint16_t * bins)
+{
+	uint16_t min[CODEC_MAX_BINS];
+	uint16_t max[CODEC_MAX_BINS];
+	uint8_t count = 0;
+
+	for(uint16_t i = 0; i < edges; i++){
+		uint8_t bin;
+		for(bin = 0; bin < count; bin++){
+			if(codec_in_tolerance(ir[i], bins[bin])){
+				break;
+			}
+		}
+		if(bin == count){
+			if(count == CODEC_MAX_BINS){
+				return 0;
+			}
+			min[bin] = max[bin] = ir[i];
+			count++;
+		}
+		if(ir[i] < min[bin]) min[bin] = ir[i];
+		if(ir[i] > max[bin]) max[bin] = ir[i];
+		bins[bin] = min[bin] + (max[bin] - min[bin]) / 2;
+	}
+
+	// the centers move while the bins grow, every duration has to stay
+	// within the tolerance of the center it is replayed as
+	for(uint16_t i = 0; i < edges; i++){
+		if(!codec_in_tolerance(ir[i], bins[codec_nearest_bin(ir[i], bins, count)])){
+			return 0;
+		}
+	}
+
+	return count;
+}
+
+/** @brief Choose the codec with the smallest output for a command
+ * 
+ * CODEC_SYMBOL replays every timing as the center of its bin. It can only
+ * be chosen when no timing is further from that center than the codec
+ * tolerance (see codec_in_tolerance), the other codecs are lossless.
+ * 
+ * @param ir Timings to be stored
+ * @param edges Number of edges in ir
+ * @param lossless 1 to leave out CODEC_SYMBOL, for timings that already
+ *                 stand for others within the tolerance
+ * @return codec id
+ */
+uint8_t codec_choose(uint16_t * ir, uint16_t edges, uint8_t lossless)
+{
+	uint8_t best = CODEC_RAW;
+	uint16_t best_length = codec_encode(CODEC_RAW, ir, edges, 0, 0);
+
+	static const uint8_t codecs[] = {CODEC_DELTA, CODEC_SYMBOL, CODEC_BYTE};
+	for(uint8_t i = 0; i < sizeof(codecs); i++){
+		if(lossless && codecs[i] == CODEC_SYMBOL){
+			continue;
+		}
+		uint16_t length = codec_encode(codecs[i], ir, edges, 0, 0);
+		if(length != 0 && length < best_length){
+			best = codecs[i];
+			best_length = length;
+		}
+	}
+
+	return best;
+}
+
+/** @brief Look for a frame that is repeated over the whole recording
+ * 
+ * The recording has to be the same frame (within the tolerance of
+ * codec_in_tolerance) sent several times, always with the same space in
+ * between. The first frame and the first space are kept. The later
+ * frames are replayed as the first one, so it has to be stored with a
+ * lossless codec (codec_choose with lossless set); CODEC_SYMBOL could
+ * add another tolerance on top.
+ * 
+ * @param ir Recorded timings
+ * @param edges Number of edges in ir
+ * @param repeat (out) Number of repeats and gap, codec is not set
+ * @return number of edges of the frame, 0 if ir is no repeated frame
+ */
+uint16_t codec_find_repeat(uint16_t * ir, uint16_t edges, struct codec_repeat * repeat)
+{
+	// frame, gap, frame, ..., frame: every frame ends with a mark
+	for(uint16_t frame = 1; frame * 2 < edges; frame += 2){
+		if((edges + 1) % (frame + 1) != 0){
+			continue;
+		}
+		uint16_t frames = (edges + 1) / (frame + 1);
+		if(frames - 1 > 0xFF){
+			continue;
+		}
+
+		uint16_t i;
+		for(i = frame + 1; i < edges; i++){
+			uint16_t first = ir[i % (frame + 1)];
+			if(!codec_in_tolerance(ir[i], first)){
+				break;
+			}
+		}
+		if(i == edges){
+			repeat->repeats = frames - 1;
+			repeat->gap = ir[frame];
+			return frame;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Check the codec of the frame of a CODEC_REPEAT record
+ * 
+ * Only codecs that decode timings byte by byte can hold the frame. A
+ * CODEC_REPEAT inside would be decoded recursively, once per header.
+ * 
+ * @param codec Codec id from struct codec_repeat
+ * @return 1 if the frame can be decoded, 0 otherwise
+ */
+uint8_t codec_frame_valid(uint8_t codec)
+{
+	return codec == CODEC_RAW || codec == CODEC_DELTA || codec == CODEC_SYMBOL || codec == CODEC_BYTE;
+}
+
+/** @brief Prepare an encoder for a new record (CODEC_DELTA)
+ * 
+ * @param encoder Encoder state
+ */
+void codec_encoder_init(struct codec_encoder * encoder)
+{
+	encoder->previous[0] = 0;
+	encoder->previous[1] = 0;
+	encoder->level = 0;
+}
+
+/** @brief Encode the next edge of a record (CODEC_DELTA)
+ * 
+ * The delta codec needs no look ahead, so a record can be encoded while
+ * its edges are still being recorded.
+ * 
+ * @param encoder Encoder state
+ * @param edge Next timing
+ * @param emit Output function or 0
+ * @param context Passed to emit
+ * @return number of encoded bytes (1 - 3)
+ */
+uint8_t codec_encode_edge(struct codec_encoder * encoder, uint16_t edge, codec_emit_t emit, void * context)
+{
+	int16_t delta = edge - encoder->previous[encoder->level];
+	uint16_t zigzag = ((uint16_t)delta << 1) ^ (delta < 0 ? 0xFFFF : 0);
+	uint8_t length = 0;
+	encoder->previous[encoder->level] = edge;
+	encoder->level ^= 1;
+
+	// 7 bits per byte, highest bit set if more bytes follow
+	do {
+		uint8_t byte = zigzag & 0x7f;
+		zigzag >>= 7;
+		if(zigzag){
+			byte |= 0x80;
+		}
+		if(emit){
+			emit(byte, context);
+		}
+		length++;
+	} while(zigzag);
+
+	return length;
+}
+
+/** @brief Encode timings
+ * 
+ * Every output byte is passed to emit. With emit set to 0 only the
+ * length of the output is calculated.
+ * 
+ * @param codec Codec id
+ * @param ir Timings to be encoded
+ * @param edges Number of edges in ir
+ * @param emit Output function or 0
+ * @param context Passed to emit
+ * @return number of encoded bytes, 0 if the codec can not encode ir
+ */
+uint16_t codec_encode(uint8_t codec, uint16_t * ir, uint16_t edges, codec_emit_t emit, void * context)
+{
+	uint16_t length = 0;
+
+	switch(codec){
+	case CODEC_RAW:
+		for(uint16_t i = 0; i < edges; i++){
+			if(emit){
+				emit(ir[i] & 0xff, context);
+				emit(ir[i] >> 8, context);
+			}
+		}
+		length = edges * 2;
+		break;
+
+	case CODEC_DELTA: {
+		struct codec_encoder encoder;
+		codec_encoder_init(&encoder);
+		for(uint16_t i = 0; i < edges; i++){
+			length += codec_encode_edge(&encoder, ir[i], emit, context);
+		}
+		break;
+	}
+
+	case CODEC_BYTE:
+		for(uint16_t i = 0; i < edges; i++){
+			if(ir[i] < CODEC_BYTE_ESCAPE){
+				if(emit){
+					emit(ir[i], context);
+				}
+				length++;
+				continue;
+			}
+			if(emit){
+				emit(CODEC_BYTE_ESCAPE, context);
+				emit(ir[i] & 0xff, context);
+				emit(ir[i] >> 8, context);
+			}
+			length += 3;
+		}
+		break;
+
+	case CODEC_SYMBOL: {
+		// header: bin count, edge count, bins; then 2 indices per byte
+		uint16_t bins[CODEC_MAX_BINS];
+		uint8_t count = codec_build_bins(ir, edges, bins);
+		if(count == 0){
+			return 0;
+		}
+		length = 3 + count * 2 + (edges + 1) / 2;
+		if(!emit){
+			break;
+		}
+
+		emit(count, context);
+		emit(edges & 0xff, context);
+		emit(edges >> 8, context);
+		for(uint8_t bin = 0; bin < count; bin++){
+			emit(bins[bin] & 0xff, context);
+			emit(bins[bin] >> 8, context);
+		}
+		for(uint16_t i = 0; i < edges; i += 2){
+			uint8_t byte = codec_nearest_bin(ir[i], bins, count);
+			if(i + 1 < edges){
+				byte |= codec_nearest_bin(ir[i + 1], bins, count) << 4;
+			}
+			emit(byte, context);
+		}
+		break;
+	}
+	}
+
+	return length;
+}
+
+/** @brief Prepare a decoder for a new record
+ * 
+ * @param decoder Decoder state
+ * @param codec Codec id of the record
+ */
+void codec_decoder_init(struct codec_decoder * decoder, uint8_t codec)
+{
+	decoder->codec = codec;
+	decoder->position = 0;
+	decoder->value = 0;
+	decoder->previous[0] = 0;
+	decoder->previous[1] = 0;
+	decoder->level = 0;
+	decoder->bins_count = 0;
+	decoder->edges = 0;
+}
+
+/** @brief Decode one byte of a record
+ * 
+ * The decoded edges are stored in decoder->out.
+ * 
+ * @param decoder Decoder state
+ * @param byte Next byte of the record
+ * @return number of edges decoded from this byte (0 - 2)
+ */
+uint8_t codec_decode_byte(struct codec_decoder * decoder, uint8_t byte)
+{
+	switch(decoder->codec){
+	case CODEC_RAW:
+		if(decoder->position == 0){
+			decoder->value = byte;
+			decoder->position = 1;
+			return 0;
+		}
+		decoder->out[0] = decoder->value | (byte << 8);
+		decoder->position = 0;
+		return 1;
+
+	case CODEC_DELTA: {
+		decoder->value |= (uint16_t)(byte & 0x7f) << decoder->position;
+		if(byte & 0x80){
+			// a uint16 takes at most 3 bytes
+			if(decoder->position < 14){
+				decoder->position += 7;
+			}
+			return 0;
+		}
+		uint16_t zigzag = decoder->value;
+		int16_t delta = (zigzag >> 1) ^ -(int16_t)(zigzag & 1);
+		decoder->previous[decoder->level] += delta;
+		decoder->out[0] = decoder->previous[decoder->level];
+		decoder->level ^= 1;
+		decoder->value = 0;
+		decoder->position = 0;
+		return 1;
+	}
+
+	case CODEC_BYTE:
+		if(decoder->position == 0){
+			if(byte != CODEC_BYTE_ESCAPE){
+				decoder->out[0] = byte;
+				return 1;
+			}
+			decoder->position = 1;
+			return 0;
+		}
+		if(decoder->position == 1){
+			decoder->value = byte;
+			decoder->position = 2;
+			return 0;
+		}
+		decoder->out[0] = decoder->value | (byte << 8);
+		decoder->position = 0;
+		return 1;
+
+	case CODEC_SYMBOL: {
+		uint8_t position = decoder->position;
+		if(position == 0){
+			// a broken header must not overrun the bins
+			decoder->bins_count = byte > CODEC_MAX_BINS ? CODEC_MAX_BINS : byte;
+		} else if(position == 1){
+			decoder->edges = byte;
+		} else if(position == 2){
+			decoder->edges |= byte << 8;
+		} else if(position < 3 + decoder->bins_count * 2){
+			uint8_t bin = (position - 3) / 2;
+			if(position & 1){
+				decoder->bins[bin] = byte;
+			} else {
+				decoder->bins[bin] |= byte << 8;
+			}
+		} else {
+			// header done, two indices per byte
+			uint8_t count = 0;
+			while(count < 2 && decoder->edges && decoder->bins_count){
+				decoder->out[count++] = decoder->bins[(byte & 0x0f) % decoder->bins_count];
+				byte >>= 4;
+				decoder->edges--;
+			}
+			return count;
+		}
+		decoder->position++;
+		return 0;
+	}
+	}
+
+	return 0;
+}
+
+/** @brief Decode a whole record that is already in RAM
+ * 
+ * @param codec Codec of the record
+ * @param payload Encoded bytes
+ * @param length Number of encoded bytes
+ * @param ir Array for the timings, terminated with 0 if not full
+ * @param size Max. number of edges in ir
+ * @return number of edges decoded, 0 if they do not fit into ir
+ */
+uint16_t codec_decode(uint8_t codec, uint8_t * payload, uint16_t length, uint16_t * ir, uint16_t size)
+{
+	struct codec_decoder decoder;
+	uint16_t edges = 0;
+
+	if(codec == CODEC_REPEAT){
+		// decode the frame once, then copy it behind each gap
+		struct codec_repeat repeat;
+		if(length < CODEC_REPEAT_SIZE){
+			return 0;
+		}
+		memcpy(&repeat, payload, CODEC_REPEAT_SIZE);
+		if(!codec_frame_valid(repeat.codec)){
+			return 0;
+		}
+		uint16_t frame = codec_decode(repeat.codec, payload + CODEC_REPEAT_SIZE, length - CODEC_REPEAT_SIZE, ir, size);
+		if(frame == 0 || frame + (uint32_t)repeat.repeats * (frame + 1) > size){
+			return 0;
+		}
+		edges = frame;
+		for(uint8_t r = 0; r < repeat.repeats; r++){
+			ir[edges++] = repeat.gap;
+			for(uint16_t i = 0; i < frame; i++){
+				ir[edges++] = ir[i];
+			}
+		}
+		if(edges < size){
+			ir[edges] = 0;
+		}
+		return edges;
+	}
+
+	codec_decoder_init(&decoder, codec);
+	for(uint16_t i = 0; i < length; i++){
+		uint8_t count = codec_decode_byte(&decoder, payload[i]);
+		for(uint8_t j = 0; j < count; j++){
+			if(edges >= size){
+				return 0;
+			}
+			ir[edges++] = decoder.out[j];
+		}
+	}
+	if(edges < size){
+		ir[edges] = 0;
+	}
+
+	return edges;
+}
@@ -0,0 +1,77 @@
+/*
+ * codec.h
+ * 
+ * This module compresses the IR timings for storage.
+ * 
+ * Recorded timings repeat a handful of distinct lengths, most of them fit
+ * into one byte. A codec turns a timing array into a byte stream for the
+ * EEPROM and back. The codec id is stored per record, so every command
+ * can use the codec that suits it best.
+ */
+
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdint.h>
+
+// codec ids, stored in the record flags
+#define CODEC_RAW 0    // uint16, low byte first
+#define CODEC_DELTA 1  // zigzag delta to the previous edge of same level, varint
+#define CODEC_SYMBOL 2 // up to 16 clustered durations, 4 bit index per edge (lossy, within 1/8)
+#define CODEC_PROTOCOL 3 // struct protocol_code, handled by protocol.c
+#define CODEC_MACRO 4    // list of struct macro_step, handled by macro.c
+#define CODEC_BYTE 5     // one byte below 0xFF, else 0xFF and uint16 low byte first
+#define CODEC_REPEAT 6   // struct codec_repeat, then one frame in the codec given there
+
+#define CODEC_MAX_BINS 16
+#define CODEC_BYTE_ESCAPE 0xFF // CODEC_BYTE: a uint16 follows
+
+/** @brief Header of a CODEC_REPEAT record
+ * 
+ * A held button sends the same frame again and again. Such a command is
+ * stored as one frame, sent repeats + 1 times with a space of gap ticks
+ * between two frames.
+ */
+struct codec_repeat {
+	uint8_t codec;   // codec of the frame
+	uint8_t repeats; // frames sent after the first one
+	uint16_t gap;    // space between two frames
+};
+
+#define CODEC_REPEAT_SIZE 4 // sizeof(struct codec_repeat)
+
+/** @brief Called for every encoded byte */
+typedef void (*codec_emit_t)(uint8_t byte, void * context);
+
+/** @brief State of a decoder, bytes are pushed into it one by one */
+struct codec_decoder {
+	uint8_t codec;
+	uint8_t position;    // header bytes consumed (symbol, byte) / varint shift (delta)
+	uint16_t value;      // value under construction
+	uint16_t previous[2];// last mark / space (delta)
+	uint8_t level;       // 0 = mark, 1 = space
+	uint8_t bins_count;
+	uint16_t edges;      // edges left (symbol)
+	uint16_t bins[CODEC_MAX_BINS];
+	uint16_t out[2];     // decoded edges of the last byte
+};
+
+/** @brief State of an encoder, edges are pushed into it one by one (delta) */
+struct codec_encoder {
+	uint16_t previous[2]; // last mark / space
+	uint8_t level;        // 0 = mark, 1 = space
+};
+
+// all doc commens can be found in .c file
+
+uint8_t codec_choose(uint16_t * ir, uint16_t edges, uint8_t lossless);
+uint16_t codec_find_repeat(uint16_t * ir, uint16_t edges, struct codec_repeat * repeat);
+uint8_t codec_frame_valid(uint8_t codec);
+void codec_encoder_init(struct codec_encoder * encoder);
+uint8_t codec_encode_edge(struct codec_encoder * encoder, uint16_t edge, codec_emit_t emit, void * context);
+uint16_t codec_encode(uint8_t codec, uint16_t * ir, uint16_t edges, codec_emit_t emit, void * context);
+void codec_decoder_init(struct codec_decoder * decoder, uint8_t codec);
+uint8_t codec_decode_byte(struct codec_decoder * decoder, uint8_t byte);
+uint16_t codec_decode(uint8_t codec, uint8_t * payload, uint16_t length, uint16_t * ir, uint16_t size);
+
+#endif /* _CODEC_H_ */
@@ -24,6 +24,16 @@
 
 #include "common.h"
 #include "string.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+// transmit buffer: uart_put appends at uart_tx_head (from main and from
+// ISRs, so atomically), USART_UDRE_vect sends from uart_tx_tail
+static volatile uint8_t uart_tx_buffer[UART_TX_BUFFER_SIZE];
+static volatile uint8_t uart_tx_head;
+static volatile uint8_t uart_tx_tail;
+volatile uint16_t uart_tx_dropped = 0;
+volatile uint8_t uart_frame_open = 0;
 
 /** @brief Init UART
  * 
@@ -37,24 +47,70 @@ void uart_init(uint32_t baudrate)
     UBRR0L = (uint8_t) (ubrr & 0xff);
     UCSR0B = (1<<TXEN0) | (1<<RXEN0); //enable RX&TX
     UCSR0A = (1<<U2X0);//UART double speed mode
+    uart_tx_head = 0;
+    uart_tx_tail = 0;
+}
+
+/** @brief Append a character to the transmit buffer
+ * @return 0 if queued, 1 if the buffer is full
+ */
+static uint8_t uart_enqueue(uint8_t c)
+{
+	uint8_t ret = 1;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t next = (uart_tx_head + 1) % UART_TX_BUFFER_SIZE;
+		if(next != uart_tx_tail) {
+			uart_tx_buffer[uart_tx_head] = c;
+			uart_tx_head = next;
+			UCSR0B |= (1<<UDRIE0); //the ISR sends it
+			ret = 0;
+		}
+	}
+
+	return ret;
+}
+
+/** @brief Queue one character without waiting
+ * @param c Character to be transmitted
+ * @return 0 if queued, 1 if dropped because the buffer is full
+ */
+uint8_t uart_put(uint8_t c)
+{
+	if(uart_enqueue(c) != 0) {
+		uart_tx_dropped++;
+		return 1;
+	}
+	return 0;
 }
 
-/** @brief Transmit one character (blocking)
+/** @brief Queue one character
+ * 
+ * With interrupts enabled this waits until the ISR made room in a full
+ * buffer. Inside an ISR (or before sei) nothing would empty the buffer,
+ * then the character is dropped.
+ * 
  * @param c Character to be transmitted
- * @note Blocking function!
  */
 void uart_transmit(uint8_t c)
 {
-	while (!( UCSR0A & (1<<UDRE0))); //wait for empty data register
-	UDR0 = c; //start TX by storing in the data register
+	if(SREG & (1 << SREG_I)) {
+		while(uart_enqueue(c) != 0);
+		return;
+	}
+	uart_put(c);
 }
 
-/** @brief Transmit a string (blocking)
+/** @brief Queue a string
  * @param str String to be sent
- * @note Blocking function!
+ * @note Same as uart_transmit, may be used inside ISRs.
  */
 void uart_sendstring(char * str )
 {
+	if(uart_frame_open) {
+		// an ISR must not log into the middle of a frame
+		return;
+	}
 	while ( * str) // send as long as not \0 terminated
 	{
 		//send & increment pointer
@@ -63,6 +119,38 @@ void uart_sendstring(char * str )
 	}
 }
 
+/** @brief Queue a string that is stored in flash
+ * @param str String in program memory, e.g. PSTR("text")
+ * @note Same as uart_sendstring.
+ */
+void uart_sendstring_P(const char * str )
+{
+	if(uart_frame_open) {
+		return;
+	}
+	char c;
+	while ((c = pgm_read_byte(str)))
+	{
+		uart_transmit(c);
+		str++;
+	}
+}
+
+/** @brief Sends the next queued character
+ * 
+ * The interrupt is only enabled while the buffer holds characters.
+ */
+ISR(USART_UDRE_vect)
+{
+	if(uart_tx_tail != uart_tx_head) {
+		UDR0 = uart_tx_buffer[uart_tx_tail];
+		uart_tx_tail = (uart_tx_tail + 1) % UART_TX_BUFFER_SIZE;
+	}
+	if(uart_tx_tail == uart_tx_head) {
+		UCSR0B &= ~(1<<UDRIE0);
+	}
+}
+
 char* i16tos(uint16_t input) {
     // max number of numbers in uint16 is 5
     int8_t i = 5;
@@ -82,13 +170,13 @@ char* i16tos(uint16_t input) {
 }
 
 void print_command(uint16_t* ir) {
-    uart_sendstring("Loaded command: ");
+    uart_sendstring_P(PSTR("Loaded command: "));
 	while(*ir){
 		uart_sendstring(i16tos(*ir));
 		ir++;
-		uart_sendstring(", ");
+		uart_sendstring_P(PSTR(", "));
 	}
-	uart_sendstring("\r\n");
+	uart_sendstring_P(PSTR("\r\n"));
 }
 
 int8_t str_equal(char* str1, char* str2) {
@@ -103,4 +191,47 @@ int8_t str_equal(char* str1, char* str2) {
 
 void clear_array(uint16_t* arr, uint16_t length) {
     memset(arr, 0, 2*length);
-}
\ No newline at end of file
+}
+
+#if DEBUG_LOGS
+#define STACK_CANARY 0xC5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+/** @brief Paint the free RAM with STACK_CANARY before main runs */
+void stack_paint(void) __attribute__ ((naked)) __attribute__ ((section (".init1")));
+void stack_paint(void)
+{
+	__asm volatile ("    ldi r30,lo8(_end)\n"
+	                "    ldi r31,hi8(_end)\n"
+	                "    ldi r24,lo8(0xc5)\n" // STACK_CANARY
+	                "    ldi r25,hi8(__stack)\n"
+	                "    rjmp .cmp\n"
+	                ".loop:\n"
+	                "    st Z+,r24\n"
+	                ".cmp:\n"
+	                "    cpi r30,lo8(__stack)\n"
+	                "    cpc r31,r25\n"
+	                "    brlo .loop\n"
+	                "    breq .loop"::);
+}
+
+/** @brief Number of stack bytes never used since reset
+ * 
+ * The free RAM is painted with a pattern at startup, the remaining
+ * pattern between heap and stack gives the stack high-water mark.
+ */
+uint16_t stack_unused()
+{
+	const uint8_t * p = &_end;
+	uint16_t count = 0;
+
+	while(*p == STACK_CANARY && p <= &__stack) {
+		p++;
+		count++;
+	}
+
+	return count;
+}
+#endif
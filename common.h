@@ -26,6 +26,7 @@
 
 //include all modules
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <util/delay.h>
 #include "eeprom.h"
 #include "ir.h"
@@ -51,6 +52,7 @@
 #define COMMAND_RECORD 0
 #define COMMAND_REPLAY 1
 #define COMMAND_DELETE 2
+#define COMMAND_HOST 3 // a request of the host is waiting, see serial.h
 
 /** @brief Length of IR timings array
  * @warning Size in bytes is double (we allocate this number of uint16_t)
@@ -65,8 +67,6 @@
 
 #define IR_EDGES_ARR_LENGTH (MAX_IR_EDGES * 2)
 
-#define FULL_COMMAND_ARR_LENGTH (IR_EDGES_ARR_LENGTH + MAX_NAME_LEN)
-
 
 /** @brief Array of timestamps between edges
  * 
@@ -101,24 +101,59 @@ extern int8_t digit;
 ////////////////////////////////////////////////////////////////////////
 
 
+/** @brief Size of the UART transmit buffer in bytes
+ * 
+ * The characters are queued and sent by the USART_UDRE_vect ISR.
+ */
+#define UART_TX_BUFFER_SIZE 64
+
+/** @brief Characters dropped because the transmit buffer was full
+ * 
+ * Only when interrupts are disabled (inside an ISR or before sei),
+ * otherwise the sender waits for room.
+ */
+extern volatile uint16_t uart_tx_dropped;
+
+/** @brief Set while a serial frame is sent, see serial_send_start
+ * 
+ * uart_sendstring drops the text meanwhile, so log messages (also the
+ * ones from ISRs) can only appear between frames.
+ */
+extern volatile uint8_t uart_frame_open;
+
 /** @brief Init UART
  * 
  * @param baudrate Used baudrate
  */
 void uart_init(uint32_t baudrate);
 
-/** @brief Transmit one character (blocking)
+/** @brief Queue one character without waiting
  * @param c Character to be transmitted
- * @note Blocking function!
+ * @return 0 if queued, 1 if dropped because the buffer is full
+ */
+uint8_t uart_put(uint8_t c);
+
+/** @brief Queue one character
+ * @param c Character to be transmitted
+ * @note Waits for room in the buffer if interrupts are enabled, drops
+ *       the character otherwise (see uart_tx_dropped).
  */
 void uart_transmit(uint8_t c);
 
-/** @brief Transmit a string (blocking)
+/** @brief Queue a string
  * @param str String to be sent
- * @note Blocking function!
+ * @note Same as uart_transmit, may be used inside ISRs. Dropped while a
+ *       serial frame is sent (see uart_frame_open).
  */
 void uart_sendstring(char * str );
 
+/** @brief Queue a string that is stored in flash
+ * @param str String in program memory, e.g. PSTR("text")
+ * @note Same as uart_sendstring. Constant log text belongs into flash,
+ *       string literals would take SRAM for the whole runtime.
+ */
+void uart_sendstring_P(const char * str );
+
 char* i16tos(uint16_t input);
 
 void print_command(uint16_t* ir);
@@ -127,5 +162,14 @@ int8_t str_equal(char* str1, char* str2);
 
 void clear_array(uint16_t* arr, uint16_t length);
 
+#if DEBUG_LOGS
+/** @brief Number of stack bytes never used since reset
+ * 
+ * The free RAM is painted with a pattern at startup, the remaining
+ * pattern between heap and stack gives the stack high-water mark.
+ */
+uint16_t stack_unused();
+#endif
+
 
 #endif /* _COMMON_H_ */
@@ -9,64 +9,441 @@
 #include "common.h"
 #include "eeprom.h"
 #include "i2c.h"
+#include "cache.h"
+#include "codec.h"
+#include "protocol.h"
+#include "macro.h"
+#include <string.h>
+#include <util/crc16.h>
 
+/** @brief Occupancy of the directory, one bit per command index
+ * 
+ * Built once in eeprom_init and kept up to date by store/delete, so
+ * browsing and counting commands need no bus traffic.
+ */
+static uint8_t slot_bitmap[(MAX_COMMANDS + 7) / 8];
+
+/** @brief Usage of the data blocks, one bit per block after DATA_FIRST_BLOCK */
+static uint8_t block_bitmap[(DATA_BLOCKS + 7) / 8];
+
+/** @brief Hash of every stored name, valid where slot_bitmap is set
+ * 
+ * A name lookup only has to read the directory entries whose hash
+ * matches, which is usually just the one we are looking for.
+ */
+static uint8_t name_hashes[MAX_COMMANDS];
+
+static uint8_t bitmap_get(uint8_t * bitmap, uint16_t bit)
+{
+	return bitmap[bit / 8] & (1 << (bit % 8));
+}
+
+static void bitmap_set(uint8_t * bitmap, uint16_t bit, uint8_t value)
+{
+	if(value) {
+		bitmap[bit / 8] |= (1 << (bit % 8));
+	} else {
+		bitmap[bit / 8] &= ~(1 << (bit % 8));
+	}
+}
+
+/** @brief Read the directory entry of a command
+ * 
+ * @return 0 when successful, MEM_BUS_ERROR otherwise
+ */
+static uint8_t eeprom_read_entry(uint8_t index, struct eeprom_entry * entry)
+{
+	if(cache_read(DIRECTORY_ADDRESS + index * ENTRY_SIZE, (uint8_t*)entry, ENTRY_SIZE) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+	return MEM_SUCCESS;
+}
+
+/** @brief Read the next directory entry of a sequential read
+ * 
+ * @return 0 when successful, MEM_BUS_ERROR otherwise
+ */
+static uint8_t eeprom_read_entry_next(struct eeprom_entry * entry)
+{
+	uint8_t * bytes = (uint8_t*)entry;
+	for(uint8_t i = 0; i < ENTRY_SIZE; i++){
+		if(eeprom_read_next(&bytes[i]) != TWI_SUCCESS) {
+			return MEM_BUS_ERROR;
+		}
+	}
+	return MEM_SUCCESS;
+}
+
+/** @brief Write the directory entry of a command
+ * 
+ * The entry stays in the cache until cache_flush.
+ * 
+ * @return 0 when successful, MEM_BUS_ERROR otherwise
+ */
+static uint8_t eeprom_write_entry(uint8_t index, struct eeprom_entry * entry)
+{
+	if(cache_write(DIRECTORY_ADDRESS + index * ENTRY_SIZE, (uint8_t*)entry, ENTRY_SIZE) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+	return MEM_SUCCESS;
+}
+
+/** @brief Number of blocks a payload of the given length occupies */
+static uint16_t eeprom_record_blocks(uint16_t length)
+{
+	// rounded up without length + EEPROM_BLOCK_SIZE - 1, which overflows
+	return length / EEPROM_BLOCK_SIZE + (length % EEPROM_BLOCK_SIZE != 0);
+}
+
+/** @brief Check that the blocks of an entry lie within the data blocks
+ * 
+ * Directory entries have no checksum, a damaged or half written one
+ * must not be taken as it is.
+ */
+static uint8_t eeprom_entry_in_range(struct eeprom_entry * entry)
+{
+	return entry->block >= DATA_FIRST_BLOCK && entry->block < DATA_LAST_BLOCK
+		&& eeprom_record_blocks(entry->length) <= DATA_LAST_BLOCK - entry->block;
+}
+
+/** @brief State of the command that is streamed with eeprom_stream_fill */
+static struct {
+	union {
+		struct codec_decoder decoder;
+		struct protocol_player player; // CODEC_PROTOCOL
+	};
+	uint8_t codec;
+	struct codec_repeat repeat; // CODEC_REPEAT, repeats counts down
+	uint16_t frame;      // address of the frame (CODEC_REPEAT)
+	uint16_t frame_length; // payload bytes of the frame (CODEC_REPEAT)
+	uint8_t frames;      // frames already read again (CODEC_REPEAT)
+	uint16_t remaining;  // payload bytes not read yet
+	uint8_t decoded;     // edges in decoder.out
+	uint8_t delivered;   // edges of decoder.out already handed out
+	uint8_t checksum;
+	uint8_t expected_checksum;
+	uint8_t status;      // MEM_BUS_ERROR when a read could not be started
+} stream;
+
+/** @brief State of a command that is written while it is recorded
+ * 
+ * Two page buffers are used in turn: one is filled while the other one
+ * is written in the background by the TWI interrupt.
+ */
+static struct {
+	uint16_t block;      // first reserved block
+	uint16_t blocks;     // number of reserved blocks
+	uint16_t length;     // bytes encoded so far
+	uint8_t checksum;
+	uint8_t * pages;     // two page buffers, given by the caller
+	uint8_t page;        // buffer being filled
+	uint8_t fill;        // bytes in that buffer
+	uint8_t full;        // the reserved blocks ran out
+	uint8_t bus_error;   // a page write failed
+	struct twi_transaction write[2];
+} capture;
+
+/** @brief Collects encoded bytes and writes them page by page */
+struct eeprom_writer {
+	uint16_t address;
+	uint8_t fill;
+	uint8_t checksum;
+	uint8_t status;    // MEM_BUS_ERROR once a page write failed
+	uint8_t page[EEPROM_BLOCK_SIZE];
+};
+
+/** @brief Start a writer at the first block of a record */
+static void eeprom_writer_init(struct eeprom_writer * writer, uint16_t block)
+{
+	writer->address = block * EEPROM_BLOCK_SIZE;
+	writer->fill = 0;
+	writer->checksum = 0;
+	writer->status = MEM_SUCCESS;
+}
+
+/** @brief Write the collected bytes of a writer
+ * 
+ * @return 0 when all pages of the writer were written, MEM_BUS_ERROR otherwise
+ */
+static uint8_t eeprom_writer_flush(struct eeprom_writer * writer)
+{
+	if(writer->fill) {
+		if(eeprom_write_bytes(writer->address, writer->page, writer->fill) != TWI_SUCCESS) {
+			writer->status = MEM_BUS_ERROR;
+		}
+		writer->address += writer->fill;
+		writer->fill = 0;
+	}
+	return writer->status;
+}
+
+/** @brief codec_emit_t for eeprom_writer, records start page aligned */
+static void eeprom_writer_put(uint8_t byte, void * context)
+{
+	struct eeprom_writer * writer = context;
+	writer->checksum = _crc8_ccitt_update(writer->checksum, byte);
+	writer->page[writer->fill++] = byte;
+	if(writer->fill == EEPROM_BLOCK_SIZE) {
+		eeprom_writer_flush(writer);
+	}
+}
+
+/** @brief 8 bit hash of a name, over the characters that get stored */
+static uint8_t eeprom_name_hash(char * name)
+{
+	uint8_t hash = 0;
+	for(uint8_t i = 0; i < MAX_NAME_LEN - 1 && name[i]; i++){
+		hash = (hash * 33) ^ name[i];
+	}
+	return hash;
+}
+
+/** @brief Find the index of a name using the hash index
+ * 
+ * @return index of the command, -1 if not found
+ */
+static int8_t eeprom_find_name(char * name)
+{
+	uint8_t hash = eeprom_name_hash(name);
+	char command_name[MAX_NAME_LEN];
+
+	for(uint8_t i = 0; i < MAX_COMMANDS; i++){
+		if(!bitmap_get(slot_bitmap, i) || name_hashes[i] != hash){
+			continue;
+		}
+		// candidate, compare the real name
+		if(cache_read(DIRECTORY_ADDRESS + i * ENTRY_SIZE, (uint8_t*)command_name, MAX_NAME_LEN) != TWI_SUCCESS){
+			continue;
+		}
+		// stored names are cut to MAX_NAME_LEN - 1 characters
+		if(strncmp(name, command_name, MAX_NAME_LEN - 1) == 0){
+			return i;
+		}
+	}
+
+	return MEM_COMMAND_NOT_FOUND;
+}
+
+/** @brief Count the edges of a timing array
+ * 
+ * The array is terminated by the first 0 entry or by MAX_IR_EDGES.
+ */
+static uint16_t eeprom_count_edges(uint16_t * ir)
+{
+	uint16_t edges = 0;
+	while(edges < MAX_IR_EDGES && ir[edges]) {
+		edges++;
+	}
+	return edges;
+}
+
+/** @brief Mark the blocks of a record as used or free
+ * 
+ * Blocks outside of the data blocks are skipped.
+ */
+static void eeprom_mark_blocks(struct eeprom_entry * entry, uint8_t used)
+{
+	// a block before DATA_FIRST_BLOCK wraps around past DATA_BLOCKS
+	uint16_t block = entry->block - DATA_FIRST_BLOCK;
+	uint16_t count = eeprom_record_blocks(entry->length);
+	while(count-- && block < DATA_BLOCKS) {
+		bitmap_set(block_bitmap, block++, used);
+	}
+}
+
+/** @brief Find a slot and free blocks for a record
+ * 
+ * The blocks of a record that gets replaced stay used until the new
+ * record is committed, so a failed store leaves the old one intact.
+ * On success index, entry->block and entry->name are set, entry->length
+ * has to be set by the caller. If entry->block is not 0, the payload is already
+ * written there (free blocks reserved by eeprom_capture_open) and only
+ * a slot is found.
+ * 
+ * @return 0 when successful, error code otherwise
+ */
+static uint8_t eeprom_place_record(int8_t * index, char * name, struct eeprom_entry * entry)
+{
+	// names have to be unique, except when a command replaces itself
+	int8_t existing = eeprom_find_name(name);
+	if(existing != MEM_COMMAND_NOT_FOUND && existing != *index) {
+		uart_sendstring_P(PSTR("Name already in use\r\n"));
+		return MEM_NAME_EXISTS;
+	}
+
+	if(*index == -1) {
+		// find first empty slot
+		for(uint8_t i = 0; i < MAX_COMMANDS; i++){
+			if(!bitmap_get(slot_bitmap, i)){
+				*index = i;
+				break;
+			}
+		}
+	}
+
+	// no empty slots were found
+	if(*index == -1) {
+		return MEM_OUT_OF_MEMORY;
+	}
+
+	if(entry->block == 0) {
+		// first fit
+		uint16_t needed = eeprom_record_blocks(entry->length);
+		uint16_t run = 0;
+		uint16_t block;
+		for(block = 0; block < DATA_BLOCKS && run < needed; block++){
+			if(bitmap_get(block_bitmap, block)){
+				run = 0;
+			} else {
+				run++;
+			}
+		}
+		if(run < needed) {
+			return MEM_OUT_OF_MEMORY;
+		}
+		entry->block = DATA_FIRST_BLOCK + block - needed;
+	}
+
+	// name is padded with 0 to the full name field
+	strncpy(entry->name, name, MAX_NAME_LEN);
+	entry->name[MAX_NAME_LEN - 1] = 0;
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Make a record, whose payload is written, part of the directory
+ * 
+ * The blocks of a record stored at index before are given free only
+ * now, once the new entry is written.
+ * 
+ * @return 0 when successful, MEM_BUS_ERROR if the entry could not be
+ *         written; the record is not stored then
+ */
+static uint8_t eeprom_commit_record(int8_t index, struct eeprom_entry * entry)
+{
+	struct eeprom_entry old_entry;
+	uint8_t overwrite = bitmap_get(slot_bitmap, index);
+	if(overwrite && eeprom_read_entry(index, &old_entry) != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	// the entry is written last, so an interrupted store leaves it untouched
+	if(eeprom_write_entry(index, entry) != MEM_SUCCESS || cache_flush() != TWI_SUCCESS) {
+		// the cache may hold the entry the EEPROM did not get
+		cache_invalidate();
+		return MEM_BUS_ERROR;
+	}
+	if(overwrite) {
+		eeprom_mark_blocks(&old_entry, 0);
+	}
+	bitmap_set(slot_bitmap, index, 1);
+	name_hashes[index] = eeprom_name_hash(entry->name);
+	eeprom_mark_blocks(entry, 1);
+	return MEM_SUCCESS;
+}
 
 /** @brief Init EEPROM
  * 
  * Initialize I2C interface & EEPROM.
  * 
+ * When the EEPROM does not answer, all blocks are marked as used, so
+ * nothing is stored until the next reset.
+ * 
  * @note EEPROM memory has an "empty" value of 0xFF!
- * @return 0 on success,
+ * @return 0 on success, error code otherwise
+ * 
+ * Error codes
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer
  */
 uint8_t eeprom_init()
 {
 	#if INFO_LOGS
-	uart_sendstring("Initializing EEPROM...\r\n");
+	uart_sendstring_P(PSTR("Initializing EEPROM...\r\n"));
 	#endif
 
 	twi_init();
+	cache_invalidate();
 	// clock to output in master mode
 	DDRC |= (1 << PC6);
 
+	// nothing may be stored while the directory is unknown
+	memset(slot_bitmap, 0, sizeof(slot_bitmap));
+	memset(block_bitmap, 0xFF, sizeof(block_bitmap));
+
 	// check if EEPROM was initialized
+	// (a failed read must not be taken for a new EEPROM and format it)
 	uint8_t stored_magic_number = 0;
-	eeprom_read_bytes(MAGIC_NUMBER_ADDRESS, &stored_magic_number, 1);
+	if(eeprom_read_bytes(MAGIC_NUMBER_ADDRESS, &stored_magic_number, 1) != TWI_SUCCESS) {
+		uart_sendstring_P(PSTR("EEPROM not responding\r\n"));
+		return MEM_BUS_ERROR;
+	}
 
 	#if DEBUG_LOGS
-	uart_sendstring("Stored magic number: ");
+	uart_sendstring_P(PSTR("Stored magic number: "));
 	uart_sendstring(i16tos(stored_magic_number));
-	uart_sendstring("\r\n");
+	uart_sendstring_P(PSTR("\r\n"));
 	#endif
 
 	if(stored_magic_number != MAGIC_NUMBER){
 		// initalize EEPROM
-		uart_sendstring("Initializing new EEPROM...\r\n");
+		uart_sendstring_P(PSTR("Initializing new EEPROM...\r\n"));
 
-		// set metadata
-		eeprom_write_byte(MAGIC_NUMBER_ADDRESS, MAGIC_NUMBER);
-		_delay_ms(10);
+		// clear the directory, an entry with length 0 is empty
+		// (no delay needed, the next access polls until the write is done)
+		uint8_t zeros[EEPROM_BLOCK_SIZE];
+		memset(zeros, 0, EEPROM_BLOCK_SIZE);
+		for(uint16_t address = DIRECTORY_ADDRESS;
+			address < DIRECTORY_ADDRESS + MAX_COMMANDS * ENTRY_SIZE;
+			address += EEPROM_BLOCK_SIZE){
+			if(eeprom_write_bytes(address, zeros, EEPROM_BLOCK_SIZE) != TWI_SUCCESS) {
+				uart_sendstring_P(PSTR("EEPROM not responding\r\n"));
+				return MEM_BUS_ERROR;
+			}
+		}
 
-		// set the first byte of every command to 0, denoting an empty slot
-		for(uint8_t i = 0; i < MAX_COMMANDS; i++){
-			eeprom_write_byte(FULL_COMMAND_ARR_LENGTH * i, 0);
-			_delay_ms(10);
+		// set metadata
+		if(eeprom_write_byte(MAGIC_NUMBER_ADDRESS, MAGIC_NUMBER) != TWI_SUCCESS) {
+			uart_sendstring_P(PSTR("EEPROM not responding\r\n"));
+			return MEM_BUS_ERROR;
 		}
 	}
 
-	#if INFO_LOGS	
-	// see list of existsing commands
-	uint8_t slot;
-	char name2[MAX_NAME_LEN];
+	// read the whole directory in one go and build the bitmaps
+	struct eeprom_entry entry;
+	if(eeprom_read_start(DIRECTORY_ADDRESS) != TWI_SUCCESS) {
+		uart_sendstring_P(PSTR("EEPROM not responding\r\n"));
+		return MEM_BUS_ERROR;
+	}
+	memset(block_bitmap, 0, sizeof(block_bitmap));
 	for(uint8_t i = 0; i < MAX_COMMANDS; i++){
-		eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, &slot, 1);
-		if(slot != 0){
-			eeprom_get_command_name(i, name2);
-			uart_sendstring("Command name: ");
-			uart_sendstring(name2);
-			uart_sendstring("\r\n");
+		if(eeprom_read_entry_next(&entry) != MEM_SUCCESS){
+			break;
+		}
+		if(entry.length != 0 && !eeprom_entry_in_range(&entry)){
+			// the slot is taken as empty, a store may overwrite it
+			uart_sendstring_P(PSTR("Damaged directory entry "));
+			uart_sendstring(i16tos(i));
+			uart_sendstring_P(PSTR("\r\n"));
+		} else if(entry.length != 0){
+			bitmap_set(slot_bitmap, i, 1);
+			name_hashes[i] = eeprom_name_hash(entry.name);
+			eeprom_mark_blocks(&entry, 1);
+
+			#if INFO_LOGS
+			// see list of existsing commands
+			uart_sendstring_P(PSTR("Command name: "));
+			uart_sendstring(entry.name);
+			uart_sendstring_P(PSTR("\r\n"));
+			#endif
 		}
 	}
-	#endif
+	if(eeprom_read_stop() != TWI_SUCCESS) {
+		// a part of the directory is unknown, store nothing
+		memset(slot_bitmap, 0, sizeof(slot_bitmap));
+		memset(block_bitmap, 0xFF, sizeof(block_bitmap));
+		uart_sendstring_P(PSTR("EEPROM not responding\r\n"));
+		return MEM_BUS_ERROR;
+	}
 
 	#if DEBUG_LOGS
 	// see first few bytes of memory - for debugging
@@ -74,13 +451,13 @@ uint8_t eeprom_init()
 	eeprom_read_bytes(0, buffer, 20);
 	for(uint8_t i = 0; i < 20; i++){
 		uart_sendstring(i16tos(buffer[i]));
-		uart_sendstring(", ");
+		uart_sendstring_P(PSTR(", "));
 	}
-	uart_sendstring("\r\n");
+	uart_sendstring_P(PSTR("\r\n"));
 	#endif
 
 	#if INFO_LOGS
-	uart_sendstring("EEPROM is ready\r\n");
+	uart_sendstring_P(PSTR("EEPROM is ready\r\n"));
 	#endif
 
 	return MEM_SUCCESS;
@@ -105,20 +482,31 @@ uint8_t eeprom_init()
  */
 int8_t eeprom_get_next_command(int8_t* current_index, char* name)
 {
-	uint8_t slot;
+	#if DEBUG_LOGS
+	uint16_t transactions = twi_transactions;
+	#endif
 
-	for(uint8_t i = (*current_index + 1) % MAX_COMMANDS; 
-		i < MAX_COMMANDS + *current_index; 
-		i = (i + 1) % MAX_COMMANDS){
-		eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, &slot, 1);
-		if(slot != 0){
+	// start before index 0 if -1 was passed
+	uint8_t i = *current_index < 0 ? MAX_COMMANDS - 1 : *current_index;
+
+	for(uint8_t n = 0; n < MAX_COMMANDS; n++){
+		i = (i + 1) % MAX_COMMANDS;
+		if(bitmap_get(slot_bitmap, i)){
 			eeprom_get_command_name(i, name);
 			*current_index = i;
 
 			#if DEBUG_LOGS
-			uart_sendstring("Command name: ");
+			uart_sendstring_P(PSTR("Command name: "));
 			uart_sendstring(name);
-			uart_sendstring("\r\n");
+			uart_sendstring_P(PSTR(", bus transactions: "));
+			uart_sendstring(i16tos(twi_transactions - transactions));
+			uart_sendstring_P(PSTR(", cache hits/misses: "));
+			uart_sendstring(i16tos(cache_hits));
+			uart_sendstring_P(PSTR("/"));
+			uart_sendstring(i16tos(cache_misses));
+			uart_sendstring_P(PSTR(", UART drops: "));
+			uart_sendstring(i16tos(uart_tx_dropped));
+			uart_sendstring_P(PSTR("\r\n"));
 			#endif
 
 			return MEM_SUCCESS;
@@ -147,23 +535,31 @@ int8_t eeprom_get_next_command(int8_t* current_index, char* name)
  */
 int8_t eeprom_get_prev_command(int8_t* current_index, char* name)
 {
-	uint8_t slot;
+	#if DEBUG_LOGS
+	uint16_t transactions = twi_transactions;
+	#endif
 
-	// if current index is -1 ("start from the beginning"), set it to 1
-	*current_index = *current_index == -1 ? 1 : *current_index;
+	// if current index is -1 ("start from the beginning"), start at 1
+	uint8_t i = *current_index == -1 ? 1 : *current_index;
 
-	for(int8_t i = (*current_index - 1 + MAX_COMMANDS) % MAX_COMMANDS; 
-		i < MAX_COMMANDS + *current_index; 
-		i = (i - 1 + MAX_COMMANDS) % MAX_COMMANDS){
-		eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, &slot, 1);
-		if(slot != 0){
+	for(uint8_t n = 0; n < MAX_COMMANDS; n++){
+		i = (i - 1 + MAX_COMMANDS) % MAX_COMMANDS;
+		if(bitmap_get(slot_bitmap, i)){
 			eeprom_get_command_name(i, name);
 			*current_index = i;
 
 			#if DEBUG_LOGS
-			uart_sendstring("Command name: ");
+			uart_sendstring_P(PSTR("Command name: "));
 			uart_sendstring(name);
-			uart_sendstring("\r\n");
+			uart_sendstring_P(PSTR(", bus transactions: "));
+			uart_sendstring(i16tos(twi_transactions - transactions));
+			uart_sendstring_P(PSTR(", cache hits/misses: "));
+			uart_sendstring(i16tos(cache_hits));
+			uart_sendstring_P(PSTR("/"));
+			uart_sendstring(i16tos(cache_misses));
+			uart_sendstring_P(PSTR(", UART drops: "));
+			uart_sendstring(i16tos(uart_tx_dropped));
+			uart_sendstring_P(PSTR("\r\n"));
 			#endif
 
 			return MEM_SUCCESS;
@@ -185,14 +581,12 @@ uint16_t eeprom_get_command_count()
 {
 	uint16_t counter = 0;
 
-	uint8_t slot;
 	for(uint8_t i = 0; i < MAX_COMMANDS; i++){
-		eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, &slot, 1);
-		if(slot != 0){
+		if(bitmap_get(slot_bitmap, i)){
 			counter++;
 		}
 	}
-	
+
 	return counter;
 }
 
@@ -201,6 +595,7 @@ uint16_t eeprom_get_command_count()
  * This function returns a command index (starting with 0) for
  * a given name. It searches through all commands if this name is used.
  * If yes, the index is returned, if no -1 is returned.
+ * Only directory entries with a matching name hash are read.
  * 
  * @param name Name of the command to search for
  * @return -1 if not found, index otherwise
@@ -211,21 +606,12 @@ uint16_t eeprom_get_command_count()
 int8_t eeprom_get_command_index(char * name)
 {
 	#if INFO_LOGS
-	uart_sendstring("Getting index of command name ");
+	uart_sendstring_P(PSTR("Getting index of command name "));
 	uart_sendstring(name);
-	uart_sendstring(" ...\r\n");
+	uart_sendstring_P(PSTR(" ...\r\n"));
 	#endif
 
-	char command_name[MAX_NAME_LEN];
-
-	for(uint8_t i = 0; i < MAX_COMMANDS; i++){
-		eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, (uint8_t*)command_name, MAX_NAME_LEN);
-		if(str_equal(name, command_name)){
-			return i;
-		}
-	}
-	
-	return MEM_COMMAND_NOT_FOUND;
+	return eeprom_find_name(name);
 }
 
 /** @brief Get name for index
@@ -239,22 +625,28 @@ int8_t eeprom_get_command_index(char * name)
  * 
  * Error codes
  * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
  */
 uint8_t eeprom_get_command_name(uint8_t index, char * name)
 {
 	#if INFO_LOGS
-	uart_sendstring("Getting command name for index ");
+	uart_sendstring_P(PSTR("Getting command name for index "));
 	uart_sendstring(i16tos(index));
-	uart_sendstring("...\r\n");
+	uart_sendstring_P(PSTR("...\r\n"));
 	#endif
 
 	if(index < 0 || index >= MAX_COMMANDS) {
 		return MEM_INDEX_OUT_OF_RANGE;
 	}
 
-	uint16_t start_address_name = index * FULL_COMMAND_ARR_LENGTH;
-	eeprom_read_bytes(start_address_name, (uint8_t*)name, MAX_NAME_LEN);
-	
+	if(!bitmap_get(slot_bitmap, index)) {
+		return MEM_EMPTY_SLOT;
+	}
+
+	if(cache_read(DIRECTORY_ADDRESS + index * ENTRY_SIZE, (uint8_t*)name, MAX_NAME_LEN) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
 	return MEM_SUCCESS;
 }
 
@@ -265,156 +657,1070 @@ uint8_t eeprom_get_command_name(uint8_t index, char * name)
  * (calculated with the index). If -1 send as index, first empty slot
  * for a command will be found.
  * 
+ * Only the recorded edges (up to the first 0 in ir) are written. The record
+ * is placed into the first run of free blocks that is large enough.
+ * 
  * @param ir Pointer to array of recorded edge timings
  * @param name Pointer to name of command
  * @param index Where to store this command
+ * @param unit Tick unit of the timings (IR_UNIT_*)
  * @return 0 when successful, error code otherwise
  * 
  * Error codes
  * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
- * 2 MEM_OUT_OF_MEMORY      eeprom does not have any empty slot for storing command 
+ * 2 MEM_OUT_OF_MEMORY      eeprom does not have any empty slot for storing command
+ * 4 MEM_NO_DATA            ir does not contain any edges
+ * 6 MEM_NAME_EXISTS        another command already has this name
  */
-uint8_t eeprom_store_command(int8_t index, char * name, uint16_t * ir)
+uint8_t eeprom_store_command(int8_t index, char * name, uint16_t * ir, uint8_t unit)
 {
 	#if INFO_LOGS
-	uart_sendstring("Storing command with name ");
+	uart_sendstring_P(PSTR("Storing command with name "));
 	uart_sendstring(name);
-	uart_sendstring("...\r\n");
+	uart_sendstring_P(PSTR("...\r\n"));
 	#endif
 
 	if(index < -1 || index >= MAX_COMMANDS) {
 		return MEM_INDEX_OUT_OF_RANGE;
 	}
 
-	if(index == -1) {
-		// find first empty slot
-		uint8_t slot;
-		for(uint8_t i = 0; i < MAX_COMMANDS; i++){
-			eeprom_read_bytes(FULL_COMMAND_ARR_LENGTH * i, &slot, 1);
+	uint16_t edges = eeprom_count_edges(ir);
+	if(edges == 0) {
+		return MEM_NO_DATA;
+	}
 
-			#if DEBUG_LOGS
-			uart_sendstring("Slot ");
-			uart_sendstring(i16tos(i));
-			uart_sendstring(" is ");
-			uart_sendstring(i16tos(slot));
-			uart_sendstring("...\r\n");
-			#endif
+	// a known protocol is stored as its code, otherwise pick the codec
+	// with the smallest output; the length decides the blocks
+	struct eeprom_entry entry;
+	struct protocol_code code;
+	struct codec_repeat repeat;
+	uint16_t frame = 0;
+	uint8_t codec;
+	entry.block = 0;
+	if(protocol_decode(ir, edges, unit, &code)) {
+		codec = CODEC_PROTOCOL;
+		entry.length = PROTOCOL_CODE_SIZE;
+	} else {
+		codec = codec_choose(ir, edges, 0);
+		entry.length = codec_encode(codec, ir, edges, 0, 0);
 
-			if(slot == 0){
-				index = i;
-				break;
+		// a held button: keep one frame, repeat it on replay
+		// (the frame already stands for the others within the codec
+		// tolerance, it is stored without further loss)
+		frame = codec_find_repeat(ir, edges, &repeat);
+		if(frame) {
+			repeat.codec = codec_choose(ir, frame, 1);
+			uint16_t length = CODEC_REPEAT_SIZE + codec_encode(repeat.codec, ir, frame, 0, 0);
+			if(length < entry.length) {
+				#if DEBUG_LOGS
+				uart_sendstring_P(PSTR("Repeated frame, "));
+				uart_sendstring(i16tos(entry.length - length));
+				uart_sendstring_P(PSTR(" bytes saved\r\n"));
+				#endif
+				codec = CODEC_REPEAT;
+				entry.length = length;
 			}
 		}
 	}
+	entry.flags = codec & ENTRY_FLAGS_CODEC;
+	if(unit == IR_UNIT_500NS) {
+		entry.flags |= ENTRY_FLAGS_UNIT;
+	}
+	// the receiver does not tell the carrier, only a protocol implies it
+	uint8_t carrier = codec == CODEC_PROTOCOL ? protocol_carrier(code.protocol) : IR_CARRIER_DEFAULT;
+	entry.flags |= (carrier << ENTRY_FLAGS_CARRIER_SHIFT) & ENTRY_FLAGS_CARRIER;
 
-	// no empty slots were found
-	if(index == -1) {
-		return MEM_OUT_OF_MEMORY;
+	#if DEBUG_LOGS
+	uart_sendstring_P(PSTR("Codec "));
+	uart_sendstring(i16tos(codec));
+	if(codec == CODEC_PROTOCOL) {
+		uart_sendstring_P(PSTR(", protocol "));
+		uart_sendstring(i16tos(code.protocol));
+	}
+	uart_sendstring_P(PSTR(", "));
+	uart_sendstring(i16tos(entry.length));
+	uart_sendstring_P(PSTR(" bytes\r\n"));
+	#endif
+
+	uint8_t ret = eeprom_place_record(&index, name, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
 	}
 
-	uint16_t start_address_name = index * FULL_COMMAND_ARR_LENGTH;
-	uint16_t start_address_command = start_address_name + MAX_NAME_LEN;
-	while(*name) {
-		eeprom_write_byte(start_address_name++, *name);
-		_delay_ms(10);
-		name++;
+	// encode straight into page writes
+	struct eeprom_writer writer;
+	eeprom_writer_init(&writer, entry.block);
+	if(codec == CODEC_PROTOCOL) {
+		for(uint8_t i = 0; i < PROTOCOL_CODE_SIZE; i++){
+			eeprom_writer_put(((uint8_t*)&code)[i], &writer);
+		}
+	} else if(codec == CODEC_REPEAT) {
+		for(uint8_t i = 0; i < CODEC_REPEAT_SIZE; i++){
+			eeprom_writer_put(((uint8_t*)&repeat)[i], &writer);
+		}
+		codec_encode(repeat.codec, ir, frame, eeprom_writer_put, &writer);
+	} else {
+		codec_encode(codec, ir, edges, eeprom_writer_put, &writer);
 	}
-	eeprom_write_byte(start_address_name++, 0);
-	uint8_t counter = MAX_IR_EDGES;
-	while(counter--) {
-		eeprom_write_byte(start_address_command++, *ir & 0xff);
-		_delay_ms(10);
-		eeprom_write_byte(start_address_command++, *ir >> 8);
-		_delay_ms(10);
-		ir++;
+	ret = eeprom_writer_flush(&writer);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	entry.checksum = writer.checksum;
+	ret = eeprom_commit_record(index, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
 	}
 
 	#if INFO_LOGS
-	uart_sendstring("Command stored\r\n");
+	uart_sendstring_P(PSTR("Command stored\r\n"));
 	#endif
-	
+
 	return MEM_SUCCESS;
 }
 
 /** @brief Load a command (only IR timings) from given index
  * 
  * This function loads the edge timings for a given index into the given
- * pointer to the array.
+ * pointer to the array. If the command has less than MAX_IR_EDGES edges,
+ * the timings are terminated with a 0.
  * 
  * @param ir Pointer to array where the timings will be loaded
  * @param index Where to load the command from.
+ * @param unit (out) Tick unit of the timings
  * @return 0 when successful, error code otherwise
  * 
  * Error codes
  * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
+ * 5 MEM_CHECKSUM_ERROR     payload does not match the stored checksum
+ * 9 MEM_RECORD_TOO_LARGE   more than MAX_IR_EDGES edges, the first ones
+ *                          are loaded
+ * 10 MEM_IS_MACRO          a macro is stored at this index
  */
-uint8_t eeprom_load_command(int8_t index, uint16_t * ir)
+uint8_t eeprom_load_command(int8_t index, uint16_t * ir, uint8_t * unit)
 {
 	#if INFO_LOGS
-	uart_sendstring("Loading command at index ");
+	uart_sendstring_P(PSTR("Loading command at index "));
 	uart_sendstring(i16tos(index));
-	uart_sendstring("...\r\n");
+	uart_sendstring_P(PSTR("...\r\n"));
 	#endif
 
-	if(index < 0 || index >= MAX_COMMANDS) {
-		return MEM_INDEX_OUT_OF_RANGE;
+	// decode straight from the bus into ir, no staging buffer
+	uint8_t ret = eeprom_stream_open(index, unit);
+	if(ret != MEM_SUCCESS) {
+		return ret;
 	}
-
-	uint16_t start_address_command = index * FULL_COMMAND_ARR_LENGTH + MAX_NAME_LEN;
-	uint8_t buffer[IR_EDGES_ARR_LENGTH];
-	eeprom_read_bytes(start_address_command, buffer, IR_EDGES_ARR_LENGTH);
-	
-	for(uint8_t i = 0; i < MAX_IR_EDGES; i++){
-		ir[i] = buffer[i * 2];
-		ir[i] |= (buffer[i * 2 + 1] << 8);
-		
-		#if DEBUG_LOGS
-		uart_sendstring(i16tos(buffer[i * 2]));
-		uart_sendstring(", ");
-		uart_sendstring(i16tos(buffer[i * 2 + 1]));
-		uart_sendstring(" -> ");
-		uart_sendstring(i16tos(ir[i]));
-		uart_sendstring(";\r\n");
-		#endif
+	uint8_t edges = eeprom_stream_fill(ir, MAX_IR_EDGES);
+	if(edges < MAX_IR_EDGES) {
+		ir[edges] = 0;
+	}
+	uint8_t truncated = stream.remaining || stream.delivered < stream.decoded || stream.repeat.repeats;
+	if(stream.codec == CODEC_PROTOCOL) {
+		// the code is read completely, ask the generator for more edges
+		truncated = edges == MAX_IR_EDGES && protocol_next(&stream.player);
+	}
+	ret = eeprom_stream_close();
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	if(truncated) {
+		// recorded straight into the EEPROM, it has to be streamed
+		return MEM_RECORD_TOO_LARGE;
 	}
 
+	#if DEBUG_LOGS
+	uart_sendstring_P(PSTR("Unused stack: "));
+	uart_sendstring(i16tos(stack_unused()));
+	uart_sendstring_P(PSTR(" bytes\r\n"));
+	#endif
+
 	#if INFO_LOGS
-	uart_sendstring("Command loaded\r\n");
+	uart_sendstring_P(PSTR("Command loaded\r\n"));
 	#endif
-	
+
 	return MEM_SUCCESS;
-} 
+}
 
 
 /** @brief Delete IR command on given index
  * 
- * This function deletes the command on the given index.
+ * This function deletes the command on the given index. Only the directory
+ * entry is cleared, the blocks of the record are free for the next store.
  * 
  * @param index Which command to delete
  * @return 0 when successful, error code otherwise
  * 
  * Error codes
  * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer, nothing was deleted
  */
 uint8_t eeprom_delete_command(int8_t index)
 {
 	#if INFO_LOGS
-	uart_sendstring("Deleting command at index ");
+	uart_sendstring_P(PSTR("Deleting command at index "));
 	uart_sendstring(i16tos(index));
-	uart_sendstring("...\r\n");
+	uart_sendstring_P(PSTR("...\r\n"));
 	#endif
 
 	if(index < 0 || index >= MAX_COMMANDS) {
 		return MEM_INDEX_OUT_OF_RANGE;
 	}
 
-	eeprom_write_byte(FULL_COMMAND_ARR_LENGTH * index, 0);
-	_delay_ms(10);
+	struct eeprom_entry entry;
+	struct eeprom_entry empty;
+	uint8_t used = bitmap_get(slot_bitmap, index);
+	if(used && eeprom_read_entry(index, &entry) != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	// the blocks are only given free once the entry is cleared
+	memset(&empty, 0, ENTRY_SIZE);
+	if(eeprom_write_entry(index, &empty) != MEM_SUCCESS || cache_flush() != TWI_SUCCESS) {
+		cache_invalidate();
+		return MEM_BUS_ERROR;
+	}
+	if(used) {
+		eeprom_mark_blocks(&entry, 0);
+		bitmap_set(slot_bitmap, index, 0);
+	}
 
 	#if INFO_LOGS
-	uart_sendstring("Command deleted\r\n");
+	uart_sendstring_P(PSTR("Command deleted\r\n"));
 	#endif
 
 	return MEM_SUCCESS;
 }
 
+/** @brief Read the whole payload of a record into RAM
+ * 
+ * Used for records that are small enough to be kept in RAM, like
+ * protocol codes, macros and commands prefetched by the macro player.
+ * 
+ * @param index Which record to read
+ * @param payload Buffer for the payload
+ * @param size Size of the buffer
+ * @param flags (out) Flags of the record (ENTRY_FLAGS_*)
+ * @param length (out) Payload size in bytes
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
+ * 5 MEM_CHECKSUM_ERROR     payload does not match the stored checksum
+ * 9 MEM_RECORD_TOO_LARGE   payload does not fit into the buffer, only
+ *                          flags and length are set
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer
+ */
+uint8_t eeprom_read_record(int8_t index, uint8_t * payload, uint16_t size, uint8_t * flags, uint16_t * length)
+{
+	if(index < 0 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+
+	if(!bitmap_get(slot_bitmap, index)) {
+		return MEM_EMPTY_SLOT;
+	}
+
+	struct eeprom_entry entry;
+	if(eeprom_read_entry(index, &entry) != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+	*flags = entry.flags;
+	*length = entry.length;
+
+	if(entry.length > size) {
+		return MEM_RECORD_TOO_LARGE;
+	}
+
+	if(eeprom_read_bytes(entry.block * EEPROM_BLOCK_SIZE, payload, entry.length) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	uint8_t checksum = 0;
+	for(uint16_t i = 0; i < entry.length; i++){
+		checksum = _crc8_ccitt_update(checksum, payload[i]);
+	}
+	if(checksum != entry.checksum) {
+		uart_sendstring_P(PSTR("Checksum error\r\n"));
+		return MEM_CHECKSUM_ERROR;
+	}
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Load the code of a command stored as a protocol code
+ * 
+ * Such a command needs no timings loaded, ir_play_protocol generates
+ * them from the code while it is sent.
+ * 
+ * @param index Which command to load
+ * @param code (out) The stored code, changed even when an error is returned
+ * @param unit (out) Tick unit the code was recorded with
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
+ * 5 MEM_CHECKSUM_ERROR     payload does not match the stored checksum
+ * 7 MEM_NOT_PROTOCOL       the command is stored as timings
+ */
+uint8_t eeprom_load_protocol(int8_t index, struct protocol_code * code, uint8_t * unit)
+{
+	uint8_t flags;
+	uint16_t length;
+	uint8_t ret = eeprom_read_record(index, (uint8_t*)code, PROTOCOL_CODE_SIZE, &flags, &length);
+	if(ret != MEM_SUCCESS && ret != MEM_RECORD_TOO_LARGE) {
+		return ret;
+	}
+	if((flags & ENTRY_FLAGS_CODEC) != CODEC_PROTOCOL || length != PROTOCOL_CODE_SIZE) {
+		return MEM_NOT_PROTOCOL;
+	}
+
+	*unit = (flags & ENTRY_FLAGS_UNIT) ? IR_UNIT_500NS : IR_UNIT_16US;
+	return MEM_SUCCESS;
+}
+
+/** @brief Store a macro
+ * 
+ * A macro is stored like a command, under its own name, but its payload
+ * is the list of steps instead of timings.
+ * 
+ * @param index Where to store the macro, -1 for the first empty slot
+ * @param name Name of the macro
+ * @param steps Steps of the macro
+ * @param count Number of steps (1 - MACRO_MAX_STEPS)
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 2 MEM_OUT_OF_MEMORY      eeprom does not have any empty slot for storing command
+ * 3 MEM_EMPTY_SLOT         a step refers to an index without a command
+ * 4 MEM_NO_DATA            no steps or too many steps
+ * 6 MEM_NAME_EXISTS        another command already has this name
+ * 10 MEM_IS_MACRO          a step refers to a macro, macros do not nest
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer
+ * 13 MEM_BAD_RECORD        a step repeats more than MACRO_MAX_REPEATS times
+ */
+uint8_t eeprom_store_macro(int8_t index, char * name, struct macro_step * steps, uint8_t count)
+{
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Storing macro with name "));
+	uart_sendstring(name);
+	uart_sendstring_P(PSTR("...\r\n"));
+	#endif
+
+	if(index < -1 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+
+	if(count == 0 || count > MACRO_MAX_STEPS) {
+		return MEM_NO_DATA;
+	}
+
+	struct eeprom_entry entry;
+	uint8_t ret;
+	for(uint8_t i = 0; i < count; i++){
+		if(steps[i].repeats > MACRO_MAX_REPEATS) {
+			return MEM_BAD_RECORD;
+		}
+		ret = eeprom_get_entry(steps[i].index, &entry);
+		if(ret != MEM_SUCCESS) {
+			return ret;
+		}
+		if((entry.flags & ENTRY_FLAGS_CODEC) == CODEC_MACRO) {
+			return MEM_IS_MACRO;
+		}
+	}
+
+	entry.block = 0;
+	entry.length = count * MACRO_STEP_SIZE;
+	entry.flags = CODEC_MACRO;
+
+	ret = eeprom_place_record(&index, name, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+
+	// a macro fits into one page
+	struct eeprom_writer writer;
+	eeprom_writer_init(&writer, entry.block);
+	for(uint8_t i = 0; i < entry.length; i++){
+		eeprom_writer_put(((uint8_t*)steps)[i], &writer);
+	}
+	ret = eeprom_writer_flush(&writer);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	entry.checksum = writer.checksum;
+	ret = eeprom_commit_record(index, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Macro stored\r\n"));
+	#endif
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Load the steps of a macro
+ * 
+ * @param index Which macro to load
+ * @param steps (out) Steps of the macro, room for MACRO_MAX_STEPS; changed
+ *              even when an error is returned
+ * @param count (out) Number of steps
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
+ * 5 MEM_CHECKSUM_ERROR     payload does not match the stored checksum
+ * 8 MEM_NOT_MACRO          a command is stored at this index
+ */
+uint8_t eeprom_load_macro(int8_t index, struct macro_step * steps, uint8_t * count)
+{
+	uint8_t flags;
+	uint16_t length;
+	uint8_t ret = eeprom_read_record(index, (uint8_t*)steps, MACRO_MAX_STEPS * MACRO_STEP_SIZE, &flags, &length);
+	if(ret != MEM_SUCCESS && ret != MEM_RECORD_TOO_LARGE) {
+		return ret;
+	}
+	if((flags & ENTRY_FLAGS_CODEC) != CODEC_MACRO) {
+		return MEM_NOT_MACRO;
+	}
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+
+	*count = length / MACRO_STEP_SIZE;
+	return MEM_SUCCESS;
+}
+
+/** @brief Write the filled capture page in the background
+ * 
+ * The other page buffer is filled next, once its own write is done.
+ */
+static void eeprom_capture_submit()
+{
+	struct twi_transaction * write = &capture.write[capture.page];
+	write->type = TWI_WRITE;
+	write->addr = capture.block * EEPROM_BLOCK_SIZE + capture.length - capture.fill;
+	write->data = capture.pages + capture.page * EEPROM_BLOCK_SIZE;
+	write->size = capture.fill;
+	write->done = 0;
+	// the queue also drains with interrupts off
+	twi_queue(write);
+
+	capture.page ^= 1;
+	capture.fill = 0;
+	if(twi_wait(&capture.write[capture.page]) != TWI_SUCCESS) {
+		capture.bus_error = 1;
+	}
+}
+
+/** @brief Wait until both capture pages are written
+ * 
+ * @return 0 when all pages were written, MEM_BUS_ERROR otherwise
+ */
+static uint8_t eeprom_capture_wait()
+{
+	if(twi_wait(&capture.write[0]) != TWI_SUCCESS) {
+		capture.bus_error = 1;
+	}
+	if(twi_wait(&capture.write[1]) != TWI_SUCCESS) {
+		capture.bus_error = 1;
+	}
+	return capture.bus_error ? MEM_BUS_ERROR : MEM_SUCCESS;
+}
+
+/** @brief codec_emit_t for the capture pages */
+static void eeprom_capture_emit(uint8_t byte, void * context)
+{
+	if(capture.length == capture.blocks * EEPROM_BLOCK_SIZE) {
+		capture.full = 1;
+		return;
+	}
+	capture.pages[capture.page * EEPROM_BLOCK_SIZE + capture.fill++] = byte;
+	capture.length++;
+	capture.checksum = _crc8_ccitt_update(capture.checksum, byte);
+	if(capture.fill == EEPROM_BLOCK_SIZE) {
+		eeprom_capture_submit();
+	}
+}
+
+/** @brief Reset the capture state for the blocks in capture.block / blocks */
+static void eeprom_capture_start(uint8_t * buffer)
+{
+	capture.length = 0;
+	capture.checksum = 0;
+	capture.pages = buffer;
+	capture.page = 0;
+	capture.fill = 0;
+	capture.full = 0;
+	capture.bus_error = 0;
+	capture.write[0].status = TWI_SUCCESS;
+	capture.write[1].status = TWI_SUCCESS;
+}
+
+/** @brief Start writing a command while it is recorded
+ * 
+ * Reserves the largest run of free blocks, so the command can be as long
+ * as the free memory allows. The CODEC_BYTE encoded timings are then
+ * passed byte by byte to eeprom_capture_put. Only eeprom_capture_put
+ * may be used until eeprom_capture_close or eeprom_capture_abort.
+ * 
+ * @param buffer 2 * EEPROM_BLOCK_SIZE bytes for the page buffers, in use
+ *               until the capture is closed
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 2 MEM_OUT_OF_MEMORY      no free block
+ */
+uint8_t eeprom_capture_open(uint8_t * buffer)
+{
+	// largest run of free blocks
+	uint16_t run = 0;
+	capture.blocks = 0;
+	for(uint16_t block = 0; block < DATA_BLOCKS; block++){
+		if(bitmap_get(block_bitmap, block)){
+			run = 0;
+			continue;
+		}
+		run++;
+		if(run > capture.blocks) {
+			capture.blocks = run;
+			capture.block = DATA_FIRST_BLOCK + block + 1 - run;
+		}
+	}
+	if(capture.blocks == 0) {
+		return MEM_OUT_OF_MEMORY;
+	}
+
+	eeprom_capture_start(buffer);
+
+	#if DEBUG_LOGS
+	uart_sendstring_P(PSTR("Capture reserved "));
+	uart_sendstring(i16tos(capture.blocks));
+	uart_sendstring_P(PSTR(" blocks\r\n"));
+	#endif
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Add the next byte of a captured command
+ * 
+ * Fits ir_sink_t, so it can take the bytes of ir_record_stream directly.
+ * They are already CODEC_BYTE encoded by the capture ISR and are written
+ * as they are.
+ * 
+ * @param byte Next byte of the encoded timings
+ * @return 0 when successful, MEM_OUT_OF_MEMORY when the reserved blocks are full
+ */
+uint8_t eeprom_capture_put(uint8_t byte)
+{
+	eeprom_capture_emit(byte, 0);
+	return capture.full ? MEM_OUT_OF_MEMORY : MEM_SUCCESS;
+}
+
+/** @brief Finish a captured command and store it under a name
+ * 
+ * @param index Where to store the command, -1 for the first empty slot
+ * @param name Name of the command
+ * @param unit Tick unit of the timings
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 2 MEM_OUT_OF_MEMORY      the command did not fit / no empty slot
+ * 4 MEM_NO_DATA            no timings were captured
+ * 6 MEM_NAME_EXISTS        another command already has this name
+ * 12 MEM_BUS_ERROR         a page write failed
+ */
+uint8_t eeprom_capture_close(int8_t index, char * name, uint8_t unit)
+{
+	if(capture.fill) {
+		eeprom_capture_submit();
+	}
+	if(eeprom_capture_wait() != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	if(index < -1 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+	if(capture.full) {
+		return MEM_OUT_OF_MEMORY;
+	}
+	if(capture.length == 0) {
+		return MEM_NO_DATA;
+	}
+
+	struct eeprom_entry entry;
+	entry.block = capture.block;
+	entry.length = capture.length;
+	entry.flags = CODEC_BYTE | (IR_CARRIER_DEFAULT << ENTRY_FLAGS_CARRIER_SHIFT);
+	if(unit == IR_UNIT_500NS) {
+		entry.flags |= ENTRY_FLAGS_UNIT;
+	}
+	entry.checksum = capture.checksum;
+
+	uint8_t ret = eeprom_place_record(&index, name, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	ret = eeprom_commit_record(index, &entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Command stored, "));
+	uart_sendstring(i16tos(entry.length));
+	uart_sendstring_P(PSTR(" bytes\r\n"));
+	#endif
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Stop a capture without storing it
+ * 
+ * Waits for the page writes in progress, the reserved blocks stay free.
+ * Also stops an import.
+ */
+void eeprom_capture_abort()
+{
+	eeprom_capture_wait();
+}
+
+/** @brief Get the directory entry of a record
+ * 
+ * Used to export a record with eeprom_read_payload.
+ * 
+ * @param index Index of the record
+ * @param entry (out) Its directory entry
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no record is stored at this index
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer
+ */
+uint8_t eeprom_get_entry(int8_t index, struct eeprom_entry * entry)
+{
+	if(index < 0 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+
+	if(!bitmap_get(slot_bitmap, index)) {
+		return MEM_EMPTY_SLOT;
+	}
+
+	return eeprom_read_entry(index, entry);
+}
+
+/** @brief Read a part of the payload of a record as it is stored
+ * 
+ * @param entry Directory entry of the record, see eeprom_get_entry
+ * @param offset First payload byte to read
+ * @param data Buffer for the bytes
+ * @param size Number of bytes to read, the end of the payload is not
+ *             checked
+ * @return 0 when successful, MEM_BUS_ERROR otherwise
+ */
+uint8_t eeprom_read_payload(struct eeprom_entry * entry, uint16_t offset, uint8_t * data, uint16_t size)
+{
+	if(eeprom_read_bytes(entry->block * EEPROM_BLOCK_SIZE + offset, data, size) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+	return MEM_SUCCESS;
+}
+
+// record that is imported, committed by eeprom_import_close
+static struct eeprom_entry import_entry;
+static int8_t import_index;
+
+/** @brief Check the flags and length of an imported entry
+ * 
+ * The checksum only tells that the payload arrived as it was exported,
+ * not that another remote (or the host) made a valid record.
+ */
+static uint8_t eeprom_import_entry_valid(struct eeprom_entry * entry)
+{
+	uint8_t carrier = (entry->flags & ENTRY_FLAGS_CARRIER) >> ENTRY_FLAGS_CARRIER_SHIFT;
+	// the highest bit is not used
+	if(entry->flags & ~(ENTRY_FLAGS_CODEC | ENTRY_FLAGS_UNIT | ENTRY_FLAGS_CARRIER) || carrier >= IR_CARRIERS) {
+		return 0;
+	}
+
+	switch(entry->flags & ENTRY_FLAGS_CODEC) {
+	case CODEC_RAW:
+	case CODEC_DELTA:
+	case CODEC_SYMBOL:
+	case CODEC_BYTE:
+		return 1;
+	case CODEC_PROTOCOL:
+		return entry->length == PROTOCOL_CODE_SIZE;
+	case CODEC_MACRO:
+		return entry->length % MACRO_STEP_SIZE == 0 && entry->length <= MACRO_MAX_STEPS * MACRO_STEP_SIZE;
+	case CODEC_REPEAT:
+		return entry->length > CODEC_REPEAT_SIZE;
+	default:
+		return 0;
+	}
+}
+
+/** @brief Check the structure of an imported payload once it is written
+ * 
+ * Protocol codes, macro steps and the header of repeated frames are read
+ * back into the page buffers of the import.
+ * 
+ * @return 0 when the record can be used, MEM_BAD_RECORD or MEM_BUS_ERROR
+ */
+static uint8_t eeprom_import_payload_valid()
+{
+	uint8_t codec = import_entry.flags & ENTRY_FLAGS_CODEC;
+	uint8_t * payload = capture.pages;
+	uint8_t valid = 1;
+
+	if(codec != CODEC_PROTOCOL && codec != CODEC_MACRO && codec != CODEC_REPEAT) {
+		return MEM_SUCCESS;
+	}
+	// at most MACRO_MAX_STEPS steps, one page
+	uint8_t size = codec == CODEC_MACRO ? import_entry.length : codec == CODEC_REPEAT ? CODEC_REPEAT_SIZE : PROTOCOL_CODE_SIZE;
+	if(eeprom_read_payload(&import_entry, 0, payload, size) != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	if(codec == CODEC_PROTOCOL) {
+		valid = protocol_code_valid((struct protocol_code*)payload);
+	} else if(codec == CODEC_REPEAT) {
+		valid = codec_frame_valid(((struct codec_repeat*)payload)->codec);
+	} else {
+		struct macro_step * steps = (struct macro_step*)payload;
+		for(uint8_t i = 0; i < size / MACRO_STEP_SIZE; i++){
+			if(steps[i].index < 0 || steps[i].index >= MAX_COMMANDS || steps[i].repeats > MACRO_MAX_REPEATS) {
+				valid = 0;
+			}
+		}
+	}
+
+	return valid ? MEM_SUCCESS : MEM_BAD_RECORD;
+}
+
+/** @brief Start importing a record exported by another remote
+ * 
+ * The payload is then passed in pieces to eeprom_import_put and written
+ * page by page in the background, like a captured command. Only
+ * eeprom_import_put may be used until eeprom_import_close or
+ * eeprom_capture_abort.
+ * 
+ * @param index Where to store the record, -1 for the first empty slot
+ * @param entry Entry of the exported record (name, length, flags,
+ *              checksum), block is not used
+ * @param buffer 2 * EEPROM_BLOCK_SIZE bytes for the page buffers, in use
+ *               until the import is closed
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 2 MEM_OUT_OF_MEMORY      no empty slot / not enough free blocks
+ * 4 MEM_NO_DATA            the record has no payload
+ * 6 MEM_NAME_EXISTS        another command already has this name
+ * 11 MEM_SLOT_USED         a record is stored at index already
+ * 13 MEM_BAD_RECORD        flags or length do not make a valid record
+ */
+uint8_t eeprom_import_open(int8_t index, struct eeprom_entry * entry, uint8_t * buffer)
+{
+	if(index < -1 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+	if(index != -1 && bitmap_get(slot_bitmap, index)) {
+		// an import never replaces a stored record
+		return MEM_SLOT_USED;
+	}
+	if(entry->length == 0) {
+		return MEM_NO_DATA;
+	}
+	if(!eeprom_import_entry_valid(entry)) {
+		return MEM_BAD_RECORD;
+	}
+
+	char name[MAX_NAME_LEN];
+	memcpy(name, entry->name, MAX_NAME_LEN);
+	name[MAX_NAME_LEN - 1] = 0;
+	import_entry = *entry;
+	import_entry.block = 0;
+	uint8_t ret = eeprom_place_record(&index, name, &import_entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	import_index = index;
+
+	capture.block = import_entry.block;
+	capture.blocks = eeprom_record_blocks(import_entry.length);
+	eeprom_capture_start(buffer);
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Add the next part of an imported payload
+ * 
+ * Waits only when both page buffers are being written.
+ * 
+ * @param data Payload bytes
+ * @param size Number of bytes
+ * @return 0 when successful, MEM_OUT_OF_MEMORY when more bytes than the
+ *         record length are passed
+ */
+uint8_t eeprom_import_put(uint8_t * data, uint8_t size)
+{
+	for(uint8_t i = 0; i < size; i++){
+		eeprom_capture_emit(data[i], 0);
+	}
+	return capture.full || capture.length > import_entry.length ? MEM_OUT_OF_MEMORY : MEM_SUCCESS;
+}
+
+/** @brief Finish an import and store the record
+ * 
+ * The record is only stored when its length and checksum match the
+ * exported entry and its payload can be used on this remote.
+ * 
+ * @param index (out) Index of the stored record
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 2 MEM_OUT_OF_MEMORY      more bytes than the record length were passed
+ * 4 MEM_NO_DATA            less bytes than the record length were passed
+ * 5 MEM_CHECKSUM_ERROR     payload does not match the exported checksum
+ * 12 MEM_BUS_ERROR         a page write failed
+ * 13 MEM_BAD_RECORD        invalid protocol code, macro step or frame codec
+ */
+uint8_t eeprom_import_close(int8_t * index)
+{
+	if(capture.fill) {
+		eeprom_capture_submit();
+	}
+	if(eeprom_capture_wait() != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	if(capture.full || capture.length > import_entry.length) {
+		return MEM_OUT_OF_MEMORY;
+	}
+	if(capture.length < import_entry.length) {
+		return MEM_NO_DATA;
+	}
+	if(capture.checksum != import_entry.checksum) {
+		uart_sendstring_P(PSTR("Checksum error\r\n"));
+		return MEM_CHECKSUM_ERROR;
+	}
+
+	uint8_t ret = eeprom_import_payload_valid();
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	ret = eeprom_commit_record(import_index, &import_entry);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	*index = import_index;
+
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Record imported\r\n"));
+	#endif
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Start streaming a command
+ * 
+ * Opens a sequential read of the payload, the timings are then fetched
+ * piece by piece with eeprom_stream_fill. No other EEPROM function may
+ * be used until eeprom_stream_close is called.
+ * 
+ * @param index Which command to stream
+ * @param unit (out) Tick unit of the timings
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 1 MEM_INDEX_OUT_OF_RANGE passed index does not exits
+ * 3 MEM_EMPTY_SLOT         no command is stored at this index
+ * 10 MEM_IS_MACRO          a macro is stored at this index
+ * 12 MEM_BUS_ERROR         the EEPROM did not answer
+ * 13 MEM_BAD_RECORD        the frame of repeated frames has no timing codec
+ */
+uint8_t eeprom_stream_open(int8_t index, uint8_t * unit)
+{
+	if(index < 0 || index >= MAX_COMMANDS) {
+		return MEM_INDEX_OUT_OF_RANGE;
+	}
+
+	if(!bitmap_get(slot_bitmap, index)) {
+		return MEM_EMPTY_SLOT;
+	}
+
+	struct eeprom_entry entry;
+	if(eeprom_read_entry(index, &entry) != MEM_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	if((entry.flags & ENTRY_FLAGS_CODEC) == CODEC_MACRO) {
+		// steps, not timings
+		return MEM_IS_MACRO;
+	}
+
+	stream.codec = entry.flags & ENTRY_FLAGS_CODEC;
+	codec_decoder_init(&stream.decoder, stream.codec);
+	*unit = (entry.flags & ENTRY_FLAGS_UNIT) ? IR_UNIT_500NS : IR_UNIT_16US;
+	stream.remaining = entry.length;
+	stream.decoded = 0;
+	stream.delivered = 0;
+	stream.checksum = 0;
+	stream.expected_checksum = entry.checksum;
+	stream.repeat.repeats = 0;
+	stream.frames = 0;
+	stream.status = MEM_SUCCESS;
+
+	if(eeprom_read_start(entry.block * EEPROM_BLOCK_SIZE) != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	if(stream.codec == CODEC_REPEAT) {
+		// the frame is read again for every repeat
+		for(uint8_t i = 0; i < CODEC_REPEAT_SIZE && stream.remaining; i++){
+			uint8_t byte;
+			if(eeprom_read_next(&byte) != TWI_SUCCESS) {
+				eeprom_read_stop();
+				return MEM_BUS_ERROR;
+			}
+			stream.remaining--;
+			stream.checksum = _crc8_ccitt_update(stream.checksum, byte);
+			((uint8_t*)&stream.repeat)[i] = byte;
+		}
+		if(!codec_frame_valid(stream.repeat.codec)) {
+			eeprom_read_stop();
+			return MEM_BAD_RECORD;
+		}
+		stream.frame = entry.block * EEPROM_BLOCK_SIZE + CODEC_REPEAT_SIZE;
+		stream.frame_length = stream.remaining;
+		codec_decoder_init(&stream.decoder, stream.repeat.codec);
+	}
+
+	if(stream.codec == CODEC_PROTOCOL) {
+		// the timings are generated from the code, read it right away
+		struct protocol_code code;
+		memset(&code, 0, PROTOCOL_CODE_SIZE);
+		for(uint8_t i = 0; i < PROTOCOL_CODE_SIZE && stream.remaining; i++){
+			uint8_t byte;
+			if(eeprom_read_next(&byte) != TWI_SUCCESS) {
+				eeprom_read_stop();
+				return MEM_BUS_ERROR;
+			}
+			stream.remaining--;
+			stream.checksum = _crc8_ccitt_update(stream.checksum, byte);
+			((uint8_t*)&code)[i] = byte;
+		}
+		// the gaps before repeated frames do not fit 16 bit in
+		// IR_UNIT_500NS and a gap can not be split into two timings
+		// of the same level, so repeated commands are sent in IR_UNIT_16US
+		if(code.repeats) {
+			*unit = IR_UNIT_16US;
+		}
+		protocol_start(&stream.player, &code, *unit);
+	}
+
+	return MEM_SUCCESS;
+}
+
+/** @brief Fetch the next timings of a streamed command
+ * 
+ * Fits ir_fill_t, so it can feed ir_play_stream directly.
+ * 
+ * @param ir Buffer for the timings
+ * @param size Max. number of edges to fetch
+ * @return number of edges fetched, 0 at the end of the command
+ */
+uint8_t eeprom_stream_fill(uint16_t * ir, uint8_t size)
+{
+	uint8_t count = 0;
+
+	if(stream.codec == CODEC_PROTOCOL) {
+		uint16_t timing;
+		while(count < size && (timing = protocol_next(&stream.player))) {
+			ir[count++] = timing;
+		}
+		return count;
+	}
+
+	while(count < size) {
+		if(stream.delivered < stream.decoded) {
+			ir[count++] = stream.decoder.out[stream.delivered++];
+			continue;
+		}
+		if(stream.remaining == 0) {
+			if(stream.repeat.repeats == 0) {
+				break;
+			}
+			// the gap, then the frame once more
+			ir[count++] = stream.repeat.gap;
+			stream.repeat.repeats--;
+			stream.frames++;
+			stream.remaining = stream.frame_length;
+			codec_decoder_init(&stream.decoder, stream.repeat.codec);
+			if(eeprom_read_stop() != TWI_SUCCESS || eeprom_read_start(stream.frame) != TWI_SUCCESS) {
+				// the bus is not ours anymore, end the command here
+				stream.status = MEM_BUS_ERROR;
+				stream.remaining = 0;
+				stream.repeat.repeats = 0;
+				break;
+			}
+			continue;
+		}
+		uint8_t byte;
+		if(eeprom_read_next(&byte) != TWI_SUCCESS) {
+			// the rest of the command is lost, give the bus back
+			eeprom_read_stop();
+			stream.status = MEM_BUS_ERROR;
+			stream.remaining = 0;
+			stream.repeat.repeats = 0;
+			break;
+		}
+		stream.remaining--;
+		if(stream.frames == 0) {
+			stream.checksum = _crc8_ccitt_update(stream.checksum, byte);
+		}
+		stream.decoded = codec_decode_byte(&stream.decoder, byte);
+		stream.delivered = 0;
+	}
+
+	return count;
+}
+
+/** @brief Finish streaming a command
+ * 
+ * @return 0 when successful, error code otherwise
+ * 
+ * Error codes
+ * 5 MEM_CHECKSUM_ERROR     streamed payload does not match the stored checksum
+ * 12 MEM_BUS_ERROR         the EEPROM stopped answering
+ */
+uint8_t eeprom_stream_close()
+{
+	// after an error the bus was given back already
+	if(stream.status != MEM_SUCCESS) {
+		return stream.status;
+	}
+	if(eeprom_read_stop() != TWI_SUCCESS) {
+		return MEM_BUS_ERROR;
+	}
+
+	// only a completely streamed payload can be checked
+	if((stream.remaining == 0 || stream.frames) && stream.checksum != stream.expected_checksum) {
+		uart_sendstring_P(PSTR("Checksum error\r\n"));
+		return MEM_CHECKSUM_ERROR;
+	}
+
+	return MEM_SUCCESS;
+}
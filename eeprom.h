@@ -12,11 +12,45 @@
 
 #define MAX_IR_EDGES 250
 #define MAX_NAME_LEN 10
-#define MAX_COMMANDS (MEMORY_SIZE / (MAX_IR_EDGES * 2 + MAX_NAME_LEN))
+#define MAX_COMMANDS 120
 
-#define MAGIC_NUMBER 123
+// memory layout:
+// [directory: MAX_COMMANDS * ENTRY_SIZE][data blocks ...][metadata block]
+// the directory is packed into adjacent pages, so the whole catalog can be
+// read with one sequential read; a record takes as many consecutive blocks
+// as its payload needs
+#define EEPROM_BLOCK_SIZE 64 // one EEPROM page
+#define DIRECTORY_ADDRESS 0
+#define ENTRY_SIZE 16 // sizeof(struct eeprom_entry)
+#define DATA_FIRST_BLOCK ((MAX_COMMANDS * ENTRY_SIZE + EEPROM_BLOCK_SIZE - 1) / EEPROM_BLOCK_SIZE)
+#define DATA_LAST_BLOCK (MEMORY_SIZE / EEPROM_BLOCK_SIZE - 1) // exclusive, metadata block
+#define DATA_BLOCKS (DATA_LAST_BLOCK - DATA_FIRST_BLOCK)
+
+#define MAGIC_NUMBER 125
 #define MAGIC_NUMBER_ADDRESS (MEMORY_SIZE - 8)
 
+/** @brief Directory entry of one stored command
+ * 
+ * The payload (edge timings, encoded with the codec in flags) starts at
+ * block * EEPROM_BLOCK_SIZE and is length bytes long.
+ * An entry with length 0 is empty.
+ */
+struct eeprom_entry {
+	char name[MAX_NAME_LEN];
+	uint16_t block;
+	uint16_t length;   // payload size in bytes
+	uint8_t flags;     // record format, see ENTRY_FLAGS_*
+	uint8_t checksum;  // CRC-8 of the payload
+};
+
+#define ENTRY_FLAGS_CODEC 0x07 // codec id of the payload, see codec.h
+#define ENTRY_FLAGS_UNIT 0x08  // set: timings in IR_UNIT_500NS, else IR_UNIT_16US
+#define ENTRY_FLAGS_CARRIER 0x70 // carrier profile, see IR_CARRIER_* in ir.h
+#define ENTRY_FLAGS_CARRIER_SHIFT 4
+
+struct protocol_code; // see protocol.h
+struct macro_step;    // see macro.h
+
 // all doc commens can be found in .c file
 // strategic solution - in order not to recompile headers when comments change
 // and keep documentation & implementation together
@@ -27,15 +61,43 @@ int8_t eeprom_get_prev_command(int8_t* current_index, char* name);
 int8_t eeprom_get_next_command(int8_t* current_index, char* name);
 int8_t eeprom_get_command_index (char * name);  
 uint8_t eeprom_get_command_name (uint8_t index, char * name);
-uint8_t eeprom_store_command (int8_t index, char * name, uint16_t * ir);  
-uint8_t eeprom_load_command (int8_t index, uint16_t * ir);
+uint8_t eeprom_store_command (int8_t index, char * name, uint16_t * ir, uint8_t unit);  
+uint8_t eeprom_load_command (int8_t index, uint16_t * ir, uint8_t * unit);
 uint8_t eeprom_delete_command (int8_t index);
+uint8_t eeprom_read_record (int8_t index, uint8_t * payload, uint16_t size, uint8_t * flags, uint16_t * length);
+uint8_t eeprom_load_protocol (int8_t index, struct protocol_code * code, uint8_t * unit);
+uint8_t eeprom_store_macro (int8_t index, char * name, struct macro_step * steps, uint8_t count);
+uint8_t eeprom_load_macro (int8_t index, struct macro_step * steps, uint8_t * count);
+uint8_t eeprom_capture_open (uint8_t * buffer);
+uint8_t eeprom_capture_put (uint8_t byte);
+uint8_t eeprom_capture_close (int8_t index, char * name, uint8_t unit);
+void eeprom_capture_abort ();
+uint8_t eeprom_get_entry (int8_t index, struct eeprom_entry * entry);
+uint8_t eeprom_read_payload (struct eeprom_entry * entry, uint16_t offset, uint8_t * data, uint16_t size);
+uint8_t eeprom_import_open (int8_t index, struct eeprom_entry * entry, uint8_t * buffer);
+uint8_t eeprom_import_put (uint8_t * data, uint8_t size);
+uint8_t eeprom_import_close (int8_t * index);
+uint8_t eeprom_stream_open (int8_t index, uint8_t * unit);
+uint8_t eeprom_stream_fill (uint16_t * ir, uint8_t size);
+uint8_t eeprom_stream_close ();
 
 #define MEM_SUCCESS 0
 #define MEM_NO_COMMANDS_FOUND -1
 #define MEM_COMMAND_NOT_FOUND -1
 #define MEM_INDEX_OUT_OF_RANGE 1
 #define MEM_OUT_OF_MEMORY 2
+#define MEM_EMPTY_SLOT 3
+#define MEM_NO_DATA 4
+#define MEM_CHECKSUM_ERROR 5
+#define MEM_NAME_EXISTS 6
+#define MEM_NOT_PROTOCOL 7
+#define MEM_NOT_MACRO 8
+#define MEM_RECORD_TOO_LARGE 9
+#define MEM_IS_MACRO 10
+#define MEM_SLOT_USED 11
+#define MEM_BUS_ERROR 12
+#define MEM_BAD_RECORD 13
+#define MEM_REPLAY_FAILED 14 // a command could not be sent, the IR_* error is logged
 
 
 #endif /* _EEPROM_H_ */
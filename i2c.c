@@ -3,14 +3,44 @@
  * 
  * This module holds implementations of functions for working with i2c.
  * 
+ * EEPROM transactions are processed by a state machine in the TWI
+ * interrupt, so the firmware keeps running while the bus is busy. The
+ * blocking eeprom_* functions queue a transaction and wait for it.
+ * 
  * Authors: Anna Sidorova, FH Technikum Wien
  */
 #include <avr/io.h>
 #include <util/delay.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/twi.h>
 #include "i2c.h"
 
+uint16_t twi_transactions = 0;
+
+// steps of a transaction between the TWI interrupts
+#define PHASE_ADDRESS_HIGH 0 // device addressed, memory address follows
+#define PHASE_ADDRESS_LOW 1
+#define PHASE_ADDRESS_DONE 2 // memory address sent, data follows
+#define PHASE_DATA 3         // data bytes sent
+
+static struct twi_transaction * volatile queue[TWI_QUEUE_SIZE];
+static volatile uint8_t queue_head = 0;
+static volatile uint8_t queue_count = 0;
+
+// bus is used by the interrupt state machine / by a sequential read
+static volatile uint8_t busy = 0;
+static volatile uint8_t locked = 0;
+
+// progress of the running transaction
+static uint8_t phase;
+static uint16_t bus_addr;
+static uint16_t bus_position;
+static uint16_t bus_retries;
+
+// result of the sequential read so far
+static uint8_t read_status;
+
 void twi_init() {
 	//Set I2C clock rate to 400kHz
 	//adjust the TWBR according to 16MHz clock!
@@ -18,6 +48,11 @@ void twi_init() {
 	TWBR = 0x0C;
 	//enable the TWI
 	TWCR = (1 << TWEN);
+
+	queue_head = 0;
+	queue_count = 0;
+	busy = 0;
+	locked = 0;
 }
 
 //send START condition
@@ -29,6 +64,8 @@ void twi_start() {
 //send STOP condition
 void twi_stop() {
 	TWCR = (1 << TWINT) | (1 << TWSTO) | (1 << TWEN);
+	// wait until STOP was sent, otherwise a following START gets lost
+	while (TWCR & (1 << TWSTO));
 }
 
 //read one byte, send ACK
@@ -56,43 +93,316 @@ uint8_t twi_getStatus() {
 	return TWSR & 0xF8; //remove unused bits by the mask
 }
 
+// continue the bus operation, the interrupt fires when it is done
+static void twi_next(uint8_t bits) {
+	TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWIE) | bits;
+}
+
+// prepare the transaction at the queue head and send START
+static void twi_begin(uint8_t bits) {
+	struct twi_transaction *transaction = queue[queue_head];
+
+	bus_addr = transaction->addr;
+	bus_position = 0;
+	bus_retries = EEPROM_POLL_RETRIES;
+	twi_transactions++;
+	busy = 1;
+	twi_next(bits | (1 << TWSTA));
+}
+
+// finish the transaction at the queue head and go on with the next one
+static void twi_finish(uint8_t status) {
+	struct twi_transaction *transaction = queue[queue_head];
+
+	queue_head = (queue_head + 1) % TWI_QUEUE_SIZE;
+	queue_count--;
+	transaction->status = status;
+	if (transaction->done) {
+		// may submit a new transaction, busy keeps it from starting
+		transaction->done(transaction);
+	}
+
+	if (queue_count && !locked) {
+		// STOP followed by START
+		twi_begin(1 << TWSTO);
+	} else {
+		TWCR = (1 << TWINT) | (1 << TWEN) | (1 << TWSTO);
+		busy = 0;
+	}
+}
+
+// state machine, one step per TWI interrupt
+static void twi_step() {
+	struct twi_transaction *transaction = queue[queue_head];
+
+	switch (TW_STATUS) {
+	case TW_START:
+		// new transaction or next page: address the device for writing
+		TWDR = CONTROL_BYTE_WRITE;
+		phase = PHASE_ADDRESS_HIGH;
+		twi_next(0);
+		break;
+
+	case TW_REP_START:
+		// memory address is set, switch to reading
+		TWDR = CONTROL_BYTE_READ;
+		twi_next(0);
+		break;
+
+	case TW_MT_SLA_NACK:
+		// EEPROM is busy with a write cycle (ACK polling), try again
+		if (--bus_retries == 0) {
+			twi_finish(TWI_TIMEOUT);
+		} else {
+			twi_next((1 << TWSTO) | (1 << TWSTA));
+		}
+		break;
+
+	case TW_MT_SLA_ACK:
+		TWDR = bus_addr >> 8;
+		phase = PHASE_ADDRESS_LOW;
+		twi_next(0);
+		break;
+
+	case TW_MT_DATA_ACK:
+		if (phase == PHASE_ADDRESS_LOW) {
+			TWDR = bus_addr & 0xff;
+			phase = PHASE_ADDRESS_DONE;
+			twi_next(0);
+		} else if (transaction->type == TWI_READ) {
+			twi_next(1 << TWSTA);
+		} else if (bus_position == transaction->size) {
+			twi_finish(TWI_SUCCESS);
+		} else if (phase == PHASE_DATA && bus_addr % EEPROM_PAGE_SIZE == 0) {
+			// page is full: STOP starts the write cycle, then go on
+			bus_retries = EEPROM_POLL_RETRIES;
+			twi_next((1 << TWSTO) | (1 << TWSTA));
+		} else {
+			TWDR = transaction->data[bus_position++];
+			bus_addr++;
+			phase = PHASE_DATA;
+			twi_next(0);
+		}
+		break;
+
+	case TW_MR_SLA_ACK:
+		// ACK every byte but the last one
+		twi_next(transaction->size > 1 ? (1 << TWEA) : 0);
+		break;
+
+	case TW_MR_DATA_ACK:
+		transaction->data[bus_position++] = TWDR;
+		twi_next(bus_position + 1 < transaction->size ? (1 << TWEA) : 0);
+		break;
+
+	case TW_MR_DATA_NACK:
+		transaction->data[bus_position++] = TWDR;
+		twi_finish(TWI_SUCCESS);
+		break;
+
+	default:
+		// bus error, lost arbitration, data NACK
+		twi_finish(TWI_ERROR);
+		break;
+	}
+}
+
+ISR(TWI_vect) {
+	twi_step();
+}
+
+// run the state machine without interrupts (before sei or inside an ISR)
+static void twi_poll() {
+	if (!(SREG & (1 << SREG_I)) && (TWCR & (1 << TWINT)) && busy) {
+		twi_step();
+	}
+}
+
+// start the queue if the bus is free
+static void twi_kick() {
+	if (!busy && !locked && queue_count) {
+		// a STOP of the previous transaction may still be on its way
+		while (TWCR & (1 << TWSTO));
+		twi_begin(0);
+	}
+}
+
+// queue a transaction, it is processed in the background
+uint8_t twi_submit(struct twi_transaction *transaction) {
+	uint8_t result = TWI_QUEUE_FULL;
+
+	if (transaction->size == 0) {
+		transaction->status = TWI_SUCCESS;
+		return TWI_SUCCESS;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (queue_count < TWI_QUEUE_SIZE) {
+			transaction->status = TWI_PENDING;
+			queue[(queue_head + queue_count) % TWI_QUEUE_SIZE] = transaction;
+			queue_count++;
+			twi_kick();
+			result = TWI_SUCCESS;
+		}
+	}
+	return result;
+}
+
+// queue a transaction, runs the bus while the queue is full
+void twi_queue(struct twi_transaction *transaction) {
+	while (twi_submit(transaction) == TWI_QUEUE_FULL) {
+		twi_poll();
+	}
+}
+
+// wait until a submitted transaction is done, returns its status
+uint8_t twi_wait(struct twi_transaction *transaction) {
+	while (transaction->status == TWI_PENDING) {
+		twi_poll();
+	}
+	return transaction->status;
+}
+
+// 1 if no transaction is queued or running
+uint8_t twi_idle() {
+	return !busy && !queue_count;
+}
+
+// queue a transaction and wait for it
+static uint8_t twi_run(struct twi_transaction *transaction) {
+	twi_queue(transaction);
+	return twi_wait(transaction);
+}
+
+// address the EEPROM for writing, poll while it is busy (ACK polling)
+//
+// The 24LC256 does not acknowledge its control byte while an internal write
+// cycle is in progress, so instead of waiting a fixed 10ms after every write
+// we retry START + control byte until the device answers.
+static uint8_t eeprom_select() {
+	uint16_t retries = EEPROM_POLL_RETRIES;
+
+	twi_transactions++;
+	do {
+		twi_start();
+		twi_write(CONTROL_BYTE_WRITE);
+		if (twi_getStatus() == TW_MT_SLA_ACK) {
+			return TWI_SUCCESS;
+		}
+	} while (--retries);
+
+	twi_stop();
+	return TWI_TIMEOUT;
+}
+
 // write byte to I2C EEPROM (MTM)
 uint8_t eeprom_write_byte(uint16_t addr, uint8_t value) {
-	twi_start();
-	twi_write(CONTROL_BYTE_WRITE);
-	
-	// write address high byte
-	twi_write(addr >> 8);
-	// write address low byte
-	twi_write(addr & 0xff);
+	return eeprom_write_bytes(addr, &value, 1);
+}
 
-	// write data
-	twi_write(value);
+// write multiple bytes to I2C EEPROM, split into page writes (MTM)
+uint8_t eeprom_write_bytes(uint16_t addr, uint8_t *values, uint16_t size) {
+	struct twi_transaction transaction;
 
-	twi_stop();
-	return 0;
+	transaction.type = TWI_WRITE;
+	transaction.addr = addr;
+	transaction.data = values;
+	transaction.size = size;
+	transaction.done = 0;
+	return twi_run(&transaction);
 }
 
 // read multiple bytes from I2C EEPROM (MRM)
 uint8_t eeprom_read_bytes(uint16_t addr, uint8_t *values, uint16_t size) {
-	twi_start();
-	twi_write(CONTROL_BYTE_WRITE);
-	
-	// write address high byte
-	twi_write(addr >> 8);
-	// write address low byte
-	twi_write(addr & 0xff);
+	struct twi_transaction transaction;
+
+	transaction.type = TWI_READ;
+	transaction.addr = addr;
+	transaction.data = values;
+	transaction.size = size;
+	transaction.done = 0;
+	return twi_run(&transaction);
+}
+
+// start a sequential read of unknown length at addr (MRM)
+//
+// Bytes are fetched one by one with eeprom_read_next, the bus stays
+// occupied until eeprom_read_stop is called.
+uint8_t eeprom_read_start(uint16_t addr) {
+	// take the bus over from the interrupt state machine
+	uint8_t done = 0;
+	while (!done) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			if (!busy) {
+				locked = 1;
+				done = 1;
+			}
+		}
+		twi_poll();
+	}
 
-	twi_start();
-	twi_write(CONTROL_BYTE_READ);
+	// a STOP of the last queued transaction may still be on its way
+	while (TWCR & (1 << TWSTO));
 
-	// read sequential data
-	while (--size) {
-		*values = twi_read_ACK();
-		values++;
+	read_status = eeprom_select();
+	if (read_status == TWI_SUCCESS) {
+		// write address high byte
+		twi_write(addr >> 8);
+		if (twi_getStatus() != TW_MT_DATA_ACK) {
+			read_status = TWI_ERROR;
+		}
+	}
+	if (read_status == TWI_SUCCESS) {
+		// write address low byte
+		twi_write(addr & 0xff);
+		if (twi_getStatus() != TW_MT_DATA_ACK) {
+			read_status = TWI_ERROR;
+		}
+	}
+	if (read_status == TWI_SUCCESS) {
+		twi_start();
+		twi_write(CONTROL_BYTE_READ);
+		if (twi_getStatus() != TW_MR_SLA_ACK) {
+			read_status = TWI_ERROR;
+		}
 	}
-	*values = twi_read_NACK();
 
+	if (read_status != TWI_SUCCESS) {
+		eeprom_read_stop();
+		return read_status;
+	}
+	return TWI_SUCCESS;
+}
+
+// read the next byte of a sequential read
+//
+// After an error the bus is not read anymore, every following call
+// returns the error as well.
+uint8_t eeprom_read_next(uint8_t *value) {
+	if (read_status == TWI_SUCCESS) {
+		*value = twi_read_ACK();
+		if (twi_getStatus() != TW_MR_DATA_ACK) {
+			read_status = TWI_ERROR;
+		}
+	}
+	return read_status;
+}
+
+// finish a sequential read, returns TWI_ERROR if a byte was not read
+uint8_t eeprom_read_stop() {
+	if (read_status == TWI_SUCCESS) {
+		// the last byte of a read has to be answered with NACK
+		twi_read_NACK();
+		if (twi_getStatus() != TW_MR_DATA_NACK) {
+			read_status = TWI_ERROR;
+		}
+	}
 	twi_stop();
-	return 0;
+
+	// hand the bus back to the queue
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		locked = 0;
+		twi_kick();
+	}
+	return read_status;
 }
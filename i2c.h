@@ -9,8 +9,61 @@
 #define CONTROL_BYTE_WRITE 0b10100000
 #define CONTROL_BYTE_READ 0b10100001
 
+// 24LC256 page buffer size, a write must not cross a page boundary
+#define EEPROM_PAGE_SIZE 64
+
+// max. number of ACK polls while the EEPROM finishes a write cycle (5ms max)
+#define EEPROM_POLL_RETRIES 1000
+
+#define TWI_SUCCESS 0
+#define TWI_TIMEOUT 1
+#define TWI_ERROR 2
+#define TWI_PENDING 3
+#define TWI_QUEUE_FULL 4
+
+// transaction types
+#define TWI_READ 0
+#define TWI_WRITE 1 // split into page writes, with ACK polling in between
+
+// max. number of queued transactions
+#define TWI_QUEUE_SIZE 4
+
+struct twi_transaction;
+
+// called from the TWI interrupt when a transaction is done
+typedef void (*twi_callback_t)(struct twi_transaction *transaction);
+
+// one EEPROM read or write, processed by the TWI interrupt
+//
+// The transaction and its data must stay valid until status is no longer
+// TWI_PENDING.
+struct twi_transaction {
+	uint8_t type;
+	uint16_t addr;
+	uint8_t *data;
+	uint16_t size;
+	twi_callback_t done; // may be 0
+	void *context;       // free for the caller
+	volatile uint8_t status;
+};
+
+// number of EEPROM transactions since reset, for measuring bus load
+extern uint16_t twi_transactions;
+
 void twi_init ();
 
+// queue a transaction, it is processed in the background
+uint8_t twi_submit (struct twi_transaction *transaction);
+
+// queue a transaction, runs the bus while the queue is full
+void twi_queue (struct twi_transaction *transaction);
+
+// wait until a submitted transaction is done, returns its status
+uint8_t twi_wait (struct twi_transaction *transaction);
+
+// 1 if no transaction is queued or running
+uint8_t twi_idle ();
+
 //send START condition
 void twi_start ();
 
@@ -32,5 +85,19 @@ uint8_t twi_getStatus ();
 // write byte to I2C EEPROM (MTM)
 uint8_t eeprom_write_byte (uint16_t addr, uint8_t value);
 
+// write multiple bytes to I2C EEPROM, split into page writes (MTM)
+uint8_t eeprom_write_bytes (uint16_t addr, uint8_t *values, uint16_t size);
+
 // read multiple bytes from I2C EEPROM (MRM)
 uint8_t eeprom_read_bytes (uint16_t addr, uint8_t *values, uint16_t size);
+
+// start a sequential read of unknown length at addr (MRM)
+// the bus is reserved until eeprom_read_stop, queued transactions wait
+uint8_t eeprom_read_start (uint16_t addr);
+
+// read the next byte of a sequential read, returns TWI_ERROR once a
+// byte could not be read
+uint8_t eeprom_read_next (uint8_t *value);
+
+// finish a sequential read, returns TWI_ERROR if a byte could not be read
+uint8_t eeprom_read_stop ();
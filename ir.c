@@ -9,36 +9,139 @@
 #include "common.h"	
 #include "avr/io.h"
 #include "ir.h"
-#include "stdio.h"
+#include "protocol.h"
+#include "codec.h"
 #include "inttypes.h"
 #include <stdint.h>
-volatile uint16_t current_timestamp=0;
+#include <avr/sleep.h>
 volatile uint16_t recording=0;
 volatile uint8_t replaying=0;
-volatile uint8_t toggle_flag=0;
 volatile uint8_t wait_for_start=0;
 
+// streaming replay: the ISR plays ir_buffer.stream[stream_active], the
+// other buffer is refilled by ir_play_stream; a count of 0 marks an empty
+// buffer
+static volatile uint8_t stream_count[2];
+static volatile uint8_t stream_active;
+static volatile uint8_t stream_position;
+static volatile uint8_t stream_end;
+static volatile uint8_t streaming=0;
+static volatile uint8_t stream_underrun;
+
+// carrier: OC0A toggles every carrier_top + 1 cycles during a mark
+#define IR_CARRIER_TOP(hz) (F_CPU / 2 / (hz) - 1)
+static const uint8_t carrier_tops[IR_CARRIERS] = {
+	IR_CARRIER_TOP(38000),
+	IR_CARRIER_TOP(36000),
+	IR_CARRIER_TOP(40000),
+	IR_CARRIER_TOP(56000),
+	IR_CARRIER_TOP(33000),
+};
+static uint8_t carrier_top = IR_CARRIER_TOP(38000);
+static volatile uint8_t replay_mark;
+
+// array replay: the ISR steps through the timings of ir_play_command
+static uint16_t * volatile array_position;
+static uint16_t * array_end;
+
+// protocol replay: the ISR asks the generator for every next timing
+static struct protocol_player synth_player;
+static volatile uint8_t synthesizing=0;
+static uint32_t synth_left; // ticks of the current timing not in OCR1A yet
+
+// capture: TIMER1_CAPT_vect appends at capture_head, ir_record_command
+// takes from capture_tail; only the ISR moves the head and only the main
+// context moves the tail, so no locking is needed
+// in compact mode the ISR stores the edges CODEC_BYTE encoded in the same
+// memory, most edges then take one byte instead of four
+// a recording and a replay never run at the same time, so the capture
+// ring and the stream buffers share their memory
+static union {
+	uint32_t edges[IR_CAPTURE_RING];
+	uint8_t bytes[IR_CAPTURE_RING_BYTES];
+	uint16_t stream[2][IR_STREAM_EDGES];
+} ir_buffer;
+static volatile uint8_t capture_head;
+static volatile uint8_t capture_tail;
+static uint8_t capture_compact;
+static volatile uint16_t capture_edges; // edges in the byte ring, compact mode
+volatile uint16_t capture_dropped=0;
+
+// timer 1 runs freely while capturing, the overflows extend it to 32 bit
+static volatile uint16_t capture_overflows;
+static uint32_t capture_last;     // timestamp of the last edge
+static uint32_t capture_deadline; // end of the recording if no edge comes
+
+static uint8_t ir_capture(uint16_t * ir, ir_sink_t sink, uint8_t * unit);
+
+/** @brief Convert a duration from IR_UNIT_500NS to IR_UNIT_16US */
+static uint32_t ir_to_coarse(uint32_t ticks)
+{
+	return (ticks + 16) / 32;
+}
+
 
 /** @brief Record an IR command
  * 
  * This function records an IR command to the given uint16 array pointer.
  * It returns when the record is finished (either OK or with error).
  * 
+ * The timings are captured in IR_CAPTURE_UNIT. If a duration does not fit
+ * into 16 bit in this unit, all timings are converted to IR_UNIT_16US.
+ * A command longer than MAX_IR_EDGES returns ARRAY_LIMIT_EXCEEDED once
+ * its end gap is seen.
+ * 
  * @param ir Pointer to array, where the timings should be stored
+ * @param unit (out) Tick unit of the timings in ir
  * @return 0 on success, error code otherwise
  * 
  * 
  */
 
-uint8_t ir_record_command(uint16_t * ir)
+uint8_t ir_record_command(uint16_t * ir, uint8_t * unit)
 {
-	uart_sendstring("Starting IR recording...\r\n");
 	if(*ir>0) return IR_ARRAY_NOT_EMPTY;
+	return ir_capture(ir, 0, unit);
+}
+
+/** @brief Record an IR command of any length
+ * 
+ * The capture ISR encodes every timing with CODEC_BYTE in IR_UNIT_16US
+ * (the ones before a long space could not be converted afterwards). The
+ * encoded bytes are handed to sink as soon as they are taken from the
+ * capture ring, nothing is kept in RAM.
+ * 
+ * @param sink Function taking the encoded bytes
+ * @param unit (out) Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_record_stream(ir_sink_t sink, uint8_t * unit)
+{
+	return ir_capture(0, sink, unit);
+}
+
+/** @brief Record an IR command into an array or a sink
+ * 
+ * @param ir Array for the timings, 0 if sink is used
+ * @param sink Function taking the CODEC_BYTE encoded timings, 0 if ir is used
+ * @param unit (out) Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ */
+static uint8_t ir_capture(uint16_t * ir, ir_sink_t sink, uint8_t * unit)
+{
+	uart_sendstring_P(PSTR("Starting IR recording...\r\n"));
 	//The edges with an odd index are falling edges, the even ones are rising edges.
-	char debug_string[100];
 	uint16_t* ip;
+	uint16_t edges = 0;
+	uint8_t overflow = 0;
 	ip = ir;
-	current_timestamp = 0;
+	*unit = sink ? IR_UNIT_16US : IR_CAPTURE_UNIT;
+	capture_compact = sink != 0;
+	capture_head = 0;
+	capture_tail = 0;
+	capture_edges = 0;
+	capture_dropped = 0;
 	wait_for_start = 1;
 	recording = 1;
 	enable_watchdog();
@@ -47,131 +150,448 @@ uint8_t ir_record_command(uint16_t * ir)
 	disable_watchdog();
 	
 	enable_input_capture();
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	
-	while(recording)
+	// the ISR collects the edges, we only move them into the array;
+	// the ring is drained once more after the recording has ended
+	while(recording || capture_tail != capture_head)
 	{
-		//uart_sendstring("Inside IR recording\r\n");
-		// if(TCNT1>32000)
-		// {
-		// 	sprintf(debug_string, "TCNT1 values is %d\r\n",TCNT1);
-		// 	uart_sendstring(debug_string);
-		// }
-		if((ip-ir)> MAX_IR_EDGES)
+		while(sink && capture_tail != capture_head)
 		{
-			disable_input_capture();
-			uart_sendstring("Array limit exceeded\r\n");
-			return ARRAY_LIMIT_EXCEEDED;
+			// already encoded by the ISR, just pass the bytes on
+			uint8_t byte = ir_buffer.bytes[capture_tail];
+			capture_tail = (capture_tail + 1) % IR_CAPTURE_RING_BYTES;
+			if(sink(byte) != 0)
+			{
+				disable_input_capture();
+				recording = 0;
+				uart_sendstring_P(PSTR("Storage full\r\n"));
+				return IR_STORAGE_FULL;
+			}
 		}
-		if(current_timestamp)
+		while(!sink && capture_tail != capture_head)
 		{
-			*ip = current_timestamp;
-			current_timestamp = 0;
+			if(edges >= MAX_IR_EDGES)
+			{
+				// throw the rest of the press away, but only stop at its
+				// end gap, so the next recording does not start inside it
+				capture_tail = capture_head;
+				overflow = 1;
+				break;
+			}
+			uint32_t duration = ir_buffer.edges[capture_tail];
+			capture_tail = (capture_tail + 1) % IR_CAPTURE_RING;
+
+			if(*unit == IR_UNIT_500NS && duration > 0xFFFF)
+			{
+				// too long for the fine unit, continue in the coarse one
+				for(uint16_t* p = ir; p < ip; p++)
+				{
+					*p = ir_to_coarse(*p);
+					if(*p == 0) *p = 1;
+				}
+				*unit = IR_UNIT_16US;
+			}
+			if(*unit != IR_CAPTURE_UNIT)
+			{
+				duration = ir_to_coarse(duration);
+			}
+			// 0 terminates the array
+			if(duration == 0) duration = 1;
+			if(duration > 0xFFFF) duration = 0xFFFF;
+			edges++;
+			*ip = duration;
 			ip++;
-			//TCNT1 = 0;
 		}
+
+		// nothing to do until the next edge, sleep (timer 1 keeps running);
+		// checked with interrupts off, so an edge can not slip in between
+		cli();
+		if(recording && capture_tail == capture_head)
+		{
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
+		}
+		sei();
 	}
 	disable_input_capture();
+	uart_sendstring_P(PSTR("End of signal detected. Stopping recording.\r\n"));
+
+	// an edge takes one or three bytes, the ISR counted the edges
+	if(sink)
+	{
+		edges = capture_edges;
+	}
 
+	if(overflow)
+	{
+		uart_sendstring_P(PSTR("Array limit exceeded\r\n"));
+		return ARRAY_LIMIT_EXCEEDED;
+	}
 
-	// uint16_t sum = 0;
-	// for(uint8_t i = 0;i<MAX_IR_EDGES;i++)
-	// 	{
-	// 		sprintf(debug_string,"The %d. timestamp is %d\r\n",i,ir[i]);
-	// 		uart_sendstring(debug_string);
-	// 		sum+=*(ir+i);
-	// 	}
-	// sprintf(debug_string,"The total command time is %d ticks.\r\n",sum);
-	// uart_sendstring(debug_string);
+	if(capture_dropped)
+	{
+		uart_sendstring_P(PSTR("Capture buffer overrun, edges dropped: "));
+		uart_sendstring(i16tos(capture_dropped));
+		uart_sendstring_P(PSTR("\r\n"));
+		return IR_CAPTURE_OVERRUN;
+	}
 
-	
-	if(ip-ir==0)
+	if(edges==0)
 	{
-		uart_sendstring("No IR data was recorded.\r\n");
+		uart_sendstring_P(PSTR("No IR data was recorded.\r\n"));
 		return IR_NO_DATA;
 	}
 
-	uart_sendstring("Recording finished\r\n");
+	uart_sendstring_P(PSTR("Recording finished\r\n"));
 	return IR_RECORDING_SUCCESSFUL;	
 }
 
 
+/**
+ * @brief OCR1A value for a timing.
+ *
+ * In CTC mode the compare match comes OCR1A + 1 ticks after the last one,
+ * so one tick less is loaded. The ISR needs a few cycles, so at least 1.
+ */
+static uint16_t replay_period(uint16_t ticks)
+{
+	return ticks > 1 ? ticks - 1 : 1;
+}
+
+/**
+ * @brief Starts the carrier and the replay timer with the first timing.
+ *
+ */
+static void replay_start(uint16_t first, uint8_t unit)
+{
+	IR_LED_DDR |= _BV(IR_LED_PIN);
+	replaying = 1;
+	enable_carrier_freq();
+	// the timer counts from 0 only once, after that CTC mode clears it on
+	// every compare match and the ISR just loads the next period
+	TCNT1 = 0;
+	OCR1A = replay_period(first);
+	enable_replay_timer(unit);
+}
+
+/**
+ * @brief Stops the carrier and the replay timer.
+ *
+ */
+static void replay_stop()
+{
+	disable_carrier_freq();
+	disable_replay_timer();
+
+	IR_LED_PORT &= ~_BV(IR_LED_PIN);
+}
+
+/**
+ * @brief Sleeps until the replay is finished, the ISR does all the work.
+ *
+ */
+static void replay_wait()
+{
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	// checked with interrupts off, so the last edge can not slip in between
+	cli();
+	while(replaying)
+	{
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+		cli();
+	}
+	sei();
+}
+
 /** @brief Replay an IR command
  * 
  * This function replays a command with the given timings from ir
- * array.
+ * array. The timer ISR steps through the array, so the timings do not
+ * depend on what the main context is doing.
  * 
  * @param ir Pointer to array, where the timings are.
+ * @param unit Tick unit of the timings
  * @return 0 on success, error code otherwise
  * 
  */
-uint8_t ir_play_command(uint16_t * ir)
+uint8_t ir_play_command(uint16_t * ir, uint8_t unit)
 {
-	uint8_t debug = 0;
-	IR_LED_DDR |= _BV(IR_LED_PIN);//set OC2A as output
-	char debug_string[100];
-	uint16_t* ip;
-	ip = ir;
-	if(debug==10)
+	if(*ir == 0)
 	{
-		uart_sendstring("The contents of the array are:\r\n");
-		while(*ip && ip-ir<=MAX_IR_EDGES)
-		{
-			sprintf(debug_string, "%d\r\n",*ip);
-			uart_sendstring(debug_string);
-			ip++;
-		}
-		ip = ir;
+		uart_sendstring_P(PSTR("No IR data to replay.\r\n"));
+		return IR_NO_DATA;
+	}
+
+	ir_play_command_start(ir, unit);
+	ir_play_wait();
+
+	uart_sendstring_P(PSTR("Replaying finished\n"));
+	return IR_REPLAY_SUCCESSFUL;
+}
 
+/** @brief Start replaying an IR command
+ * 
+ * Returns as soon as the first edge is out, the ISR plays the rest.
+ * ir must not change until ir_play_wait returns.
+ * 
+ * @param ir Pointer to array, where the timings are.
+ * @param unit Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_command_start(uint16_t * ir, uint8_t unit)
+{
+	if(*ir == 0)
+	{
+		return IR_NO_DATA;
 	}
-	replaying = 1;
-	toggle_flag = 0;
-	enable_carrier_freq();
-	OCR1A = *ip;
-	enable_replay_timer();
-	TCNT1 = 0;
-	uint8_t cntr = 0;
-	while (*ip > 0 && ip-ir<MAX_IR_EDGES)
+
+	array_position = ir;
+	array_end = ir + MAX_IR_EDGES;
+	replay_start(*ir, unit);
+	return IR_REPLAY_SUCCESSFUL;
+}
+
+/** @brief Wait until a started replay is finished
+ * 
+ * The CPU sleeps between the edges.
+ * 
+ */
+void ir_play_wait()
+{
+	replay_wait();
+	array_position = 0;
+	synthesizing = 0;
+	synth_left = 0;
+	replay_stop();
+}
+
+/**
+ * @brief Advances an array replay to the next edge, called from the ISR.
+ *
+ */
+static void array_next_edge()
+{
+	array_position++;
+	if(array_position >= array_end || *array_position == 0)
+	{
+		replaying = 0;
+		return;
+	}
+	// CTC mode clears TCNT1 on compare match, just load the next period
+	OCR1A = replay_period(*array_position);
+}
+
+/** @brief Replay an IR command while it is being loaded
+ * 
+ * Two small buffers are used in turn: the timer ISR plays one of them
+ * while this function refills the other one with the fill function.
+ * Only the first buffer has to be filled before the first edge goes out.
+ * 
+ * @param fill Function delivering the next timings
+ * @param unit Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_stream(ir_fill_t fill, uint8_t unit)
+{
+	stream_count[0] = fill(ir_buffer.stream[0], IR_STREAM_EDGES);
+	if(stream_count[0] == 0)
+	{
+		uart_sendstring_P(PSTR("No IR data to replay.\r\n"));
+		return IR_NO_DATA;
+	}
+	stream_count[1] = 0;
+	stream_active = 0;
+	stream_position = 0;
+	stream_end = 0;
+	stream_underrun = 0;
+
+	streaming = 1;
+	replay_start(ir_buffer.stream[0][0], unit);
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	// the ISR steps through the buffers, we only keep the idle one filled
+	while(replaying)
 	{
-		/* code */
-		if(debug)
+		uint8_t idle = stream_active ^ 1;
+		if(!stream_end && stream_count[idle] == 0)
 		{
-			sprintf(debug_string, "The current pointer value is %d\r\n",*ip);
-			uart_sendstring(debug_string);
+			uint8_t count = fill(ir_buffer.stream[idle], IR_STREAM_EDGES);
+			if(count == 0)
+			{
+				stream_end = 1;
+			}
+			stream_count[idle] = count;
+			continue;
 		}
-		
-		if(toggle_flag)
+
+		// nothing to refill until the ISR hands back a buffer
+		cli();
+		if(replaying && (stream_end || stream_count[stream_active ^ 1]))
 		{
-			ip++;
-			toggle_flag = 0;
-			OCR1A = *ip;
-			TCNT1 = 0;
-			if(debug)uart_sendstring("Toggle flag raised, stepping pointer.\r\n");
-			//cntr++;
+			sleep_enable();
+			sei();
+			sleep_cpu();
+			sleep_disable();
 		}
-		
-		// uart_sendstring("Current value of ip:\t");
-		// sprintf(debug_string,"%d\n",*ip);
-		// uart_sendstring(debug_string);
+		sei();
+	}
+	streaming = 0;
+	replay_stop();
 
-		
+	if(stream_underrun)
+	{
+		uart_sendstring_P(PSTR("Replay buffer underrun\n"));
+		return IR_STREAM_UNDERRUN;
 	}
-	replaying = 0;
-	disable_carrier_freq();
-	disable_replay_timer();
-	
-	IR_LED_PORT &= ~_BV(IR_LED_PIN);
-	
-	uart_sendstring("Replaying finished\n");
-	return 0;
+	uart_sendstring_P(PSTR("Replaying finished\n"));
+	return IR_REPLAY_SUCCESSFUL;
+}
+
+/** @brief Replay a command from its protocol code
+ * 
+ * The timer ISR generates every timing from the code when it is needed,
+ * so nothing has to be loaded or buffered before the first edge.
+ * 
+ * @param code Code of the command
+ * @param unit Tick unit of the generated timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_protocol(struct protocol_code * code, uint8_t unit)
+{
+	if(ir_play_protocol_start(code, unit) != IR_REPLAY_SUCCESSFUL)
+	{
+		uart_sendstring_P(PSTR("No IR data to replay.\r\n"));
+		return IR_NO_DATA;
+	}
+	ir_play_wait();
+
+	uart_sendstring_P(PSTR("Replaying finished\n"));
+	return IR_REPLAY_SUCCESSFUL;
+}
+
+/**
+ * @brief Next chunk of a protocol replay timing.
+ *
+ * Gaps between frames can be longer than 16 bit. They are sent in chunks
+ * of at least 0x8000 ticks, so the ISR always has time to load the next
+ * chunk before the counter gets there; the rest is kept in synth_left.
+ */
+static uint16_t synth_chunk(uint32_t ticks)
+{
+	if(ticks > 0xFFFF)
+	{
+		synth_left = ticks - 0x8000;
+		return 0x8000;
+	}
+	synth_left = 0;
+	return ticks;
+}
+
+/** @brief Start replaying a command from its protocol code
+ * 
+ * Returns as soon as the first edge is out, finish with ir_play_wait.
+ * The code is copied, it may change right away.
+ * 
+ * @param code Code of the command
+ * @param unit Tick unit of the generated timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_protocol_start(struct protocol_code * code, uint8_t unit)
+{
+	protocol_start(&synth_player, code, unit);
+	uint32_t first = protocol_next_long(&synth_player);
+	if(first == 0)
+	{
+		return IR_NO_DATA;
+	}
+
+	synthesizing = 1;
+	replay_start(synth_chunk(first), unit);
+	return IR_REPLAY_SUCCESSFUL;
+}
+
+/** @brief Keep repeating the frames of a protocol replay
+ * 
+ * While set, a started protocol replay goes on with repeated frames (NEC:
+ * repeat codes) at the period of the protocol. After it is cleared, the
+ * frame that is being sent is finished.
+ * 
+ * @param hold 1 to keep repeating, 0 to stop
+ */
+void ir_play_hold(uint8_t hold)
+{
+	synth_player.hold = hold;
+}
+
+/**
+ * @brief Advances a protocol replay to the next edge, called from the ISR.
+ *
+ */
+static void synth_next_edge()
+{
+	uint32_t next = protocol_next_long(&synth_player);
+	if(next == 0)
+	{
+		replaying = 0;
+		return;
+	}
+	OCR1A = replay_period(synth_chunk(next));
+}
+
+/**
+ * @brief Advances a streaming replay to the next edge, called from the ISR.
+ *
+ */
+static void stream_next_edge()
+{
+	stream_position++;
+	if(stream_position >= stream_count[stream_active])
+	{
+		// hand the drained buffer back for refilling
+		stream_count[stream_active] = 0;
+		stream_active ^= 1;
+		stream_position = 0;
+		if(stream_count[stream_active] == 0)
+		{
+			// either the command is complete or the refill was too slow
+			stream_underrun = !stream_end;
+			replaying = 0;
+			return;
+		}
+	}
+	// CTC mode clears TCNT1 on compare match, just load the next period
+	OCR1A = replay_period(ir_buffer.stream[stream_active][stream_position]);
 }
 
 void enable_input_capture(void){
 
+	capture_overflows = 0;
+	capture_last = 0;
+	capture_deadline = IR_TICKS(IR_END_GAP_US, IR_CAPTURE_UNIT);
+
+	TCCR1A = 0;
+	TCNT1 = 0;
+	OCR1B = capture_deadline & 0xFFFF;
+	// clear flags left over from before
+	TIFR1 = _BV(TOV1) | _BV(ICF1) | _BV(OCF1B);
+#if IR_CAPTURE_UNIT == IR_UNIT_500NS
+	TCCR1B =  _BV(CS11) | _BV(ICNC1);
+#else
 	TCCR1B =  _BV(CS12) | _BV(ICNC1);
+#endif
 	// TCCR1B |= _BV(CS12) | _BV(ICNC1);
 	// TCCR1B &= ~_BV(ICES1);
-	TIMSK1 |= _BV(TOIE1) | _BV(ICIE1);
-	TCNT1 = 0;
+	TIMSK1 |= _BV(TOIE1) | _BV(ICIE1) | _BV(OCIE1B);
 }
 
 /**
@@ -182,20 +602,61 @@ void disable_input_capture()
 {
 	TCNT1 = 0;
     TCCR1B &= ~(_BV(CS12) | _BV(CS10) | _BV(CS11)) ;
+    TIMSK1 &= ~_BV(OCIE1B);
+}
+
+
+/**
+ * @brief Selects the carrier for the following replays.
+ * 
+ * @param carrier Carrier profile (IR_CARRIER_*)
+ */
+void ir_set_carrier(uint8_t carrier)
+{
+	if(carrier >= IR_CARRIERS)
+	{
+		carrier = IR_CARRIER_DEFAULT;
+	}
+	carrier_top = carrier_tops[carrier];
 }
 
+/**
+ * @brief Starts a mark: OC0A goes high now and toggles from then on.
+ *
+ * The forced compare sets the output at once, and the counter restarts,
+ * so every mark begins with the same carrier phase.
+ */
+static void carrier_mark()
+{
+	TCCR0A = _BV(COM0A1) | _BV(COM0A0) | _BV(WGM01); // set on compare
+	TCCR0B = _BV(FOC0A) | _BV(CS00);
+	TCNT0 = 0;
+	TCCR0A = _BV(COM0A0) | _BV(WGM01); // toggle on compare
+}
+
+/**
+ * @brief Starts a space: OC0A goes low now and stays low.
+ *
+ */
+static void carrier_space()
+{
+	TCCR0A = _BV(COM0A1) | _BV(WGM01); // clear on compare
+	TCCR0B = _BV(FOC0A) | _BV(CS00);
+}
 
 /**
  * @brief Sets up the timer for replaying a command.
  *
+ * Timer 0 runs in CTC mode without prescaler, the compare output mode
+ * gates the carrier on OC0A. The replay starts with a mark.
  */
 void enable_carrier_freq(){
 
-     IR_LED_DDR |= _BV(IR_LED_PIN);
-     //init timer0 for PWM
-	TCCR0A |= _BV(COM0A0) | _BV(WGM01);	//ctc
-	TCCR0B |= _BV(CS01); //8 prescale
-	OCR0A =  25; //50 DTC was 25
+	IR_LED_PORT &= ~_BV(IR_LED_PIN);
+	IR_LED_DDR |= _BV(IR_LED_PIN);
+	OCR0A = carrier_top;
+	replay_mark = 1;
+	carrier_mark();
 }
 
 
@@ -204,18 +665,27 @@ void enable_carrier_freq(){
  *
  */
 void disable_carrier_freq(){
-     TCCR0B &= ~(_BV(CS00) | _BV(CS01) | _BV(CS02));
+     TCCR0B = 0;
+     TCCR0A = 0;
      IR_LED_DDR &= ~_BV(IR_LED_PIN);
 }
 
 /**
  * @brief Enables the timer required for triggering edge changes.
  *
+ * @param unit Tick unit of the timings that are replayed
  */
-void enable_replay_timer()
+void enable_replay_timer(uint8_t unit)
 {
      TCCR1A = 0;
-     TCCR1B = _BV(WGM12) | _BV(CS12);
+     if(unit == IR_UNIT_500NS)
+     {
+          TCCR1B = _BV(WGM12) | _BV(CS11);
+     }
+     else
+     {
+          TCCR1B = _BV(WGM12) | _BV(CS12);
+     }
      TIMSK1 |= _BV(OCIE1A);
 }
 
@@ -250,6 +720,45 @@ void disable_watchdog()
      WDTCSR = 0x00;
 }
 
+/**
+ * @brief Stores a captured duration CODEC_BYTE encoded, called from the ISR.
+ *
+ * The bytes of an edge are stored all together or not at all.
+ */
+static void capture_push_byte(uint32_t duration)
+{
+#if IR_CAPTURE_UNIT == IR_UNIT_500NS
+    duration = ir_to_coarse(duration);
+#endif
+    if(duration == 0) duration = 1;
+    if(duration > 0xFFFF) duration = 0xFFFF;
+
+    uint8_t size = duration < CODEC_BYTE_ESCAPE ? 1 : 3;
+    uint8_t used = (capture_head - capture_tail + IR_CAPTURE_RING_BYTES) % IR_CAPTURE_RING_BYTES;
+    if(used + size >= IR_CAPTURE_RING_BYTES)
+    {
+        // main context fell behind, the edge is lost
+        capture_dropped++;
+        return;
+    }
+
+    uint8_t head = capture_head;
+    if(size == 1)
+    {
+        ir_buffer.bytes[head] = duration;
+    }
+    else
+    {
+        ir_buffer.bytes[head] = CODEC_BYTE_ESCAPE;
+        head = (head + 1) % IR_CAPTURE_RING_BYTES;
+        ir_buffer.bytes[head] = duration & 0xff;
+        head = (head + 1) % IR_CAPTURE_RING_BYTES;
+        ir_buffer.bytes[head] = duration >> 8;
+    }
+    capture_head = (head + 1) % IR_CAPTURE_RING_BYTES;
+    capture_edges++;
+}
+
 /**
  * @brief ISR called when edge changes on PD6
  * 
@@ -258,9 +767,41 @@ ISR(TIMER1_CAPT_vect)
 {
     if(recording)
     {
-        current_timestamp = ICR1;
+        uint16_t capture = ICR1;
         TCCR1B ^= _BV(ICES1);
-        TCNT1 = 0;
+
+        // an overflow right before the capture is not counted yet, the
+        // overflow ISR has to wait until we are done
+        uint16_t overflows = capture_overflows;
+        if((TIFR1 & _BV(TOV1)) && capture < 0x8000)
+        {
+            overflows++;
+        }
+        uint32_t timestamp = ((uint32_t)overflows << 16) | capture;
+        uint32_t duration = timestamp - capture_last;
+        capture_last = timestamp;
+
+        // move the end of the recording behind this edge
+        capture_deadline = timestamp + IR_TICKS(IR_END_GAP_US, IR_CAPTURE_UNIT);
+        OCR1B = capture_deadline & 0xFFFF;
+
+        if(capture_compact)
+        {
+            capture_push_byte(duration);
+            return;
+        }
+
+        uint8_t next = (capture_head + 1) % IR_CAPTURE_RING;
+        if(next == capture_tail)
+        {
+            // main context fell behind, the edge is lost
+            capture_dropped++;
+        }
+        else
+        {
+            ir_buffer.edges[capture_head] = duration;
+            capture_head = next;
+        }
     }
 }
 
@@ -270,22 +811,69 @@ ISR(TIMER1_CAPT_vect)
  */
 ISR(TIMER1_COMPA_vect)
 {
-    if(replaying)
+    if(replaying && synth_left)
+    {
+        // a long timing goes on, the level stays
+        OCR1A = replay_period(synth_chunk(synth_left));
+    }
+    else if(replaying)
+    {
+        replay_mark ^= 1;
+        if(replay_mark)
+        {
+            carrier_mark();
+        }
+        else
+        {
+            carrier_space();
+        }
+        if(streaming)
+        {
+            stream_next_edge();
+        }
+        else if(synthesizing)
+        {
+            synth_next_edge();
+        }
+        else if(array_position)
+        {
+            array_next_edge();
+        }
+    }
+}
+
+/**
+ * @brief ISR ending the recording when no edge has been detected for
+ * IR_END_GAP_US
+ * 
+ * OCR1B holds the low 16 bit of the deadline, so this fires once per timer
+ * period; the recording ends in the period the high bits match.
+ */
+ISR(TIMER1_COMPB_vect)
+{
+    if(recording)
     {
-        IR_LED_DDR ^= _BV(IR_LED_PIN);
-        toggle_flag = 1;
+        uint16_t overflows = capture_overflows;
+        // same as in the capture ISR, the overflow ISR may still be pending
+        if((TIFR1 & _BV(TOV1)) && OCR1B < 0x8000)
+        {
+            overflows++;
+        }
+        if(overflows == (uint16_t)(capture_deadline >> 16))
+        {
+            recording = 0;
+        }
     }
 }
 
 /**
- * @brief ISR called when no edges has been detected during recording for approx. 1 sec
+ * @brief ISR extending timer 1 to 32 bit while recording
  * 
  */
 ISR(TIMER1_OVF_vect){
 	if(recording)
 	{
-		recording = 0;
-    	uart_sendstring("Timer overflow detected. Stopping recording.\n");
+		capture_overflows++;
 	}
     
 }
@@ -298,7 +886,7 @@ ISR(WDT_vect)
 {
     if(wait_for_start)
     {
-        uart_sendstring("TIMEOUT WHILE RECORDING\n");
+        uart_sendstring_P(PSTR("TIMEOUT WHILE RECORDING\n"));
         wait_for_start = 0;
         recording = 0;
     }
@@ -12,17 +12,86 @@
 
 #include "avr/interrupt.h"
 
+/** @brief Tick units of the timings
+ * 
+ * Timer 1 ticks at prescaler 256 / prescaler 8. The unit is stored with
+ * every command, so it is replayed with the timer setting it was recorded with.
+ */
+#define IR_UNIT_16US 0
+#define IR_UNIT_500NS 1
+
+/** @brief Convert microseconds to ticks of a unit */
+#define IR_TICKS(us, unit) ((unit) == IR_UNIT_500NS ? (us) * 2 : (us) / 16)
+
+/** @brief Unit used for recording
+ * 
+ * IR_UNIT_500NS gives the most accurate timings, commands with a duration
+ * over 32ms are converted to IR_UNIT_16US after recording.
+ */
+#define IR_CAPTURE_UNIT IR_UNIT_500NS
+
+/** @brief Silence after the last edge that ends a recording, in microseconds
+ * 
+ * Timed with output compare B, so the recording ends right after the gap.
+ * It has to be longer than the longest space inside a command.
+ */
+#define IR_END_GAP_US 150000UL
+
+/** @brief Carrier profiles
+ * 
+ * Timer 0 toggles OC0A (the IR LED) in CTC mode, so the duty cycle is
+ * always 50%, only the frequency can be chosen.
+ */
+#define IR_CARRIER_38KHZ 0 // NEC, Samsung and most other remotes
+#define IR_CARRIER_36KHZ 1 // RC5, RC6
+#define IR_CARRIER_40KHZ 2 // SIRC
+#define IR_CARRIER_56KHZ 3
+#define IR_CARRIER_33KHZ 4
+#define IR_CARRIERS 5
+#define IR_CARRIER_DEFAULT IR_CARRIER_38KHZ
+
 /** @brief Record an IR command
  * 
  * This function records an IR command to the given uint16 array pointer.
  * It returns when the record is finished (either OK or with error).
  * 
  * @param ir Pointer to array, where the timings should be stored
+ * @param unit (out) Tick unit of the timings in ir
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_record_command(uint16_t * ir, uint8_t * unit);
+
+
+/** @brief Takes the CODEC_BYTE encoded timings of a recording, byte by
+ * byte, see ir_record_stream
+ * 
+ * @return 0 to go on, anything else stops the recording
+ */
+typedef uint8_t (*ir_sink_t)(uint8_t byte);
+
+/** @brief Record an IR command of any length
+ * 
+ * The capture ISR encodes every timing with CODEC_BYTE, the bytes are
+ * handed to sink as soon as they are recorded, nothing is kept in RAM.
+ * The timings are always in IR_UNIT_16US.
+ * 
+ * @param sink Function taking the encoded bytes
+ * @param unit (out) Tick unit of the timings
  * @return 0 on success, error code otherwise
  * 
  */
-uint8_t ir_record_command(uint16_t * ir);
+uint8_t ir_record_stream(ir_sink_t sink, uint8_t * unit);
 
+/** @brief Number of entries in the capture ring buffer
+ * 
+ * Edges are collected by the capture ISR and moved into the record array
+ * by ir_record_command. One entry is kept free to tell full from empty.
+ * ir_record_stream uses the same memory as IR_CAPTURE_RING_BYTES bytes,
+ * so does ir_play_stream for its buffers.
+ */
+#define IR_CAPTURE_RING 32
+#define IR_CAPTURE_RING_BYTES (IR_CAPTURE_RING * 4)
 
 /** @brief Replay an IR command
  * 
@@ -30,10 +99,79 @@ uint8_t ir_record_command(uint16_t * ir);
  * array.
  * 
  * @param ir Pointer to array, where the timings are.
+ * @param unit Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_command(uint16_t * ir, uint8_t unit);
+
+/** @brief Number of edges in each of the two streaming replay buffers
+ * 
+ * Both buffers have to fit into IR_CAPTURE_RING_BYTES.
+ */
+#define IR_STREAM_EDGES 16
+
+/** @brief Source of timings for a streaming replay
+ * 
+ * Fills buffer with up to size edges.
+ * 
+ * @return number of edges filled, 0 at the end of the command
+ */
+typedef uint8_t (*ir_fill_t)(uint16_t * buffer, uint8_t size);
+
+/** @brief Replay an IR command while it is being loaded
+ * 
+ * Two small buffers are used in turn: the timer ISR plays one of them
+ * while this function refills the other one with the fill function.
+ * Only the first buffer has to be filled before the first edge goes out.
+ * 
+ * @param fill Function delivering the next timings
+ * @param unit Tick unit of the timings
+ * @return 0 on success, error code otherwise
+ * 
+ */
+uint8_t ir_play_stream(ir_fill_t fill, uint8_t unit);
+
+struct protocol_code; // see protocol.h
+
+/** @brief Replay a command from its protocol code
+ * 
+ * The timer ISR generates every timing from the code when it is needed,
+ * so nothing has to be loaded or buffered before the first edge.
+ * 
+ * @param code Code of the command
+ * @param unit Tick unit of the generated timings
  * @return 0 on success, error code otherwise
  * 
  */
-uint8_t ir_play_command(uint16_t * ir);
+uint8_t ir_play_protocol(struct protocol_code * code, uint8_t unit);
+
+/** @brief Start a replay without waiting for its end
+ * 
+ * The ISR sends the command while the caller does other work, like
+ * loading the next command. Every started replay has to be finished
+ * with ir_play_wait.
+ * 
+ * @return 0 on success, error code otherwise
+ */
+uint8_t ir_play_command_start(uint16_t * ir, uint8_t unit);
+uint8_t ir_play_protocol_start(struct protocol_code * code, uint8_t unit);
+
+/** @brief Wait until a started replay is finished */
+void ir_play_wait();
+
+/** @brief Keep repeating the frames of a started protocol replay
+ * 
+ * @param hold 1 to keep repeating, 0 to stop after the current frame
+ */
+void ir_play_hold(uint8_t hold);
+
+/** @brief Pause between two sends of a recording while a button is held
+ * 
+ * Commands stored as timings have no known frame period, they are sent
+ * again this long after the previous send ended.
+ */
+#define IR_HOLD_GAP_MS 40
 
 /**
  * @brief Enables the input capture functionality on Arduino pin 8
@@ -49,13 +187,19 @@ void disable_input_capture();
  * @brief Enables the timer for counting ticks when replaying a command.
  * 
  */
-void enable_replay_timer();
+void enable_replay_timer(uint8_t unit);
 /**
  * @brief Disables the timer for counting ticks when replaying a command.
  * 
  */
 void disable_replay_timer();
 
+/**
+ * @brief Selects the carrier for the following replays.
+ * 
+ * @param carrier Carrier profile (IR_CARRIER_*)
+ */
+void ir_set_carrier(uint8_t carrier);
 /**
  * @brief Disables timer for generating carrier frequency on Arduino pin 8
  * 
@@ -78,11 +222,10 @@ void enable_watchdog();
 void disable_watchdog();
 
 
-extern volatile uint16_t current_timestamp;
 extern volatile uint16_t recording;
 extern volatile uint8_t replaying;
-extern volatile uint8_t toggle_flag;
 extern volatile uint8_t wait_for_start;
+extern volatile uint16_t capture_dropped;
 
 #define IR_SENSOR_DDR DDRB
 #define IR_SENSOR_PORT PORTB
@@ -92,6 +235,6 @@ extern volatile uint8_t wait_for_start;
 #define IR_LED_PORT PORTD
 #define IR_LED_PIN 6
 
-enum {IR_RECORDING_SUCCESSFUL=0,IR_REPLAY_SUCCESSFUL=0,ARRAY_LIMIT_EXCEEDED,IR_NO_DATA,IR_ARRAY_NOT_EMPTY};
+enum {IR_RECORDING_SUCCESSFUL=0,IR_REPLAY_SUCCESSFUL=0,ARRAY_LIMIT_EXCEEDED,IR_NO_DATA,IR_ARRAY_NOT_EMPTY,IR_STREAM_UNDERRUN,IR_CAPTURE_OVERRUN,IR_STORAGE_FULL};
 	
 #endif /* _IR_H_ */
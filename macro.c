@@ -0,0 +1,167 @@
+/*
+ * macro.c
+ * 
+ * This module plays macros, see macro.h
+ */
+
+#include "common.h"
+#include "macro.h"
+#include "codec.h"
+#include "protocol.h"
+#include <string.h>
+
+/** @brief A command loaded ahead of its turn */
+struct macro_prefetch {
+	int8_t index;
+	uint8_t status;   // result of eeprom_read_record
+	uint8_t flags;
+	uint16_t length;
+	uint8_t payload[MACRO_PREFETCH_SIZE];
+};
+
+/** @brief Load the payload of a command into a prefetch buffer */
+static void macro_prefetch(struct macro_prefetch * prefetch, int8_t index)
+{
+	prefetch->index = index;
+	prefetch->status = eeprom_read_record(index, prefetch->payload, MACRO_PREFETCH_SIZE, &prefetch->flags, &prefetch->length);
+}
+
+/** @brief Wait between two sends */
+static void macro_delay(uint16_t ms)
+{
+	while(ms--) {
+		_delay_ms(1);
+	}
+}
+
+/** @brief Turn the result of an IR replay into a MEM_* code
+ * 
+ * The IR_* and MEM_* codes overlap, the error of the replay is logged and
+ * MEM_REPLAY_FAILED returned instead.
+ */
+static uint8_t macro_replayed(uint8_t replay)
+{
+	if(replay == IR_REPLAY_SUCCESSFUL) {
+		return MEM_SUCCESS;
+	}
+	uart_sendstring_P(PSTR("Replay failed, error "));
+	uart_sendstring(i16tos(replay));
+	uart_sendstring_P(PSTR("\r\n"));
+	return MEM_REPLAY_FAILED;
+}
+
+/** @brief Send a command that is too large to be prefetched
+ * 
+ * The command is streamed from the EEPROM while it is sent.
+ * 
+ * @return 0 on success, MEM_* error code otherwise
+ */
+static uint8_t macro_stream(int8_t index)
+{
+	uint8_t unit;
+	uint8_t ret = eeprom_stream_open(index, &unit);
+	if(ret != MEM_SUCCESS) {
+		return ret;
+	}
+	ret = macro_replayed(ir_play_stream(eeprom_stream_fill, unit));
+	uint8_t close = eeprom_stream_close();
+	return ret != MEM_SUCCESS ? ret : close;
+}
+
+/** @brief Play a macro
+ * 
+ * Sends the commands of the steps in order. While a command is being sent
+ * by the timer ISR, the next one is read from the EEPROM. A prefetched
+ * command only has to be decoded from RAM when it is its turn.
+ * 
+ * @param steps Steps of the macro
+ * @param count Number of steps
+ * @param ir Array for the timings of the command that is sent
+ * @return 0 on success, MEM_* error code of the failed load otherwise,
+ *         MEM_REPLAY_FAILED if a command could not be sent
+ */
+uint8_t macro_play(struct macro_step * steps, uint8_t count, uint16_t * ir)
+{
+	struct macro_prefetch prefetch;
+	struct protocol_code code;
+	uint8_t ret = MEM_SUCCESS;
+
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Playing macro...\r\n"));
+	#endif
+
+	if(count == 0) {
+		return MEM_NO_DATA;
+	}
+	macro_prefetch(&prefetch, steps[0].index);
+
+	for(uint8_t step = 0; step < count; step++){
+		// the prefetch holds the command of this step
+		int8_t index = prefetch.index;
+		uint8_t codec = prefetch.flags & ENTRY_FLAGS_CODEC;
+		uint8_t unit = (prefetch.flags & ENTRY_FLAGS_UNIT) ? IR_UNIT_500NS : IR_UNIT_16US;
+		uint8_t streamed = prefetch.status == MEM_RECORD_TOO_LARGE;
+
+		if(prefetch.status != MEM_SUCCESS && !streamed) {
+			ret = prefetch.status;
+			break;
+		}
+		if(codec == CODEC_MACRO) {
+			// macros do not nest
+			ret = MEM_IS_MACRO;
+			break;
+		}
+		if(!streamed) {
+			if(codec == CODEC_PROTOCOL) {
+				memcpy(&code, prefetch.payload, PROTOCOL_CODE_SIZE);
+			} else if(codec_decode(codec, prefetch.payload, prefetch.length, ir, MAX_IR_EDGES) == 0) {
+				// repeated frames can be longer than ir, send them from the EEPROM
+				streamed = 1;
+			}
+		}
+		ir_set_carrier((prefetch.flags & ENTRY_FLAGS_CARRIER) >> ENTRY_FLAGS_CARRIER_SHIFT);
+
+		// 16 bit: with 8 bit, send <= 255 would always be true
+		for(uint16_t send = 0; send <= steps[step].repeats; send++){
+			if(streamed) {
+				ret = macro_stream(index);
+			} else if(codec == CODEC_PROTOCOL) {
+				ret = macro_replayed(ir_play_protocol_start(&code, unit));
+			} else {
+				ret = macro_replayed(ir_play_command_start(ir, unit));
+			}
+			if(ret != MEM_SUCCESS) {
+				break;
+			}
+
+			// the ISR sends the command, load the next one meanwhile
+			if(send == steps[step].repeats && step + 1 < count) {
+				macro_prefetch(&prefetch, steps[step + 1].index);
+			}
+
+			if(!streamed) {
+				ir_play_wait();
+			}
+			// nothing follows the last send
+			if(send < steps[step].repeats || step + 1 < count) {
+				macro_delay(steps[step].delay_ms);
+			}
+		}
+		if(ret != MEM_SUCCESS) {
+			break;
+		}
+	}
+
+	if(ret != MEM_SUCCESS) {
+		uart_sendstring_P(PSTR("Macro stopped, error "));
+		uart_sendstring(i16tos(ret));
+		uart_sendstring_P(PSTR("\r\n"));
+		return ret;
+	}
+
+	#if INFO_LOGS
+	uart_sendstring_P(PSTR("Macro finished\r\n"));
+	#endif
+
+	return MEM_SUCCESS;
+}
@@ -0,0 +1,42 @@
+/*
+ * macro.h
+ * 
+ * This module plays macros: stored lists of commands that are sent one
+ * after the other, like "power on, input 2, volume up x5".
+ * 
+ * The next command is loaded from the EEPROM while the current one is
+ * being sent, so the gap between two commands is only the delay of the
+ * step and not the I2C load time.
+ */
+
+#ifndef _MACRO_H_
+#define _MACRO_H_
+
+#include <stdint.h>
+
+/** @brief One step of a macro
+ * 
+ * This is the payload of a CODEC_MACRO record, one entry per step.
+ */
+struct macro_step {
+	int8_t index;      // index of the command to send
+	uint8_t repeats;   // sends after the first one
+	uint16_t delay_ms; // pause after every send, but the last one of the macro
+};
+
+#define MACRO_STEP_SIZE 4  // sizeof(struct macro_step)
+#define MACRO_MAX_STEPS 16 // the steps fit into one EEPROM page
+#define MACRO_MAX_REPEATS 100 // largest repeats of a step
+
+/** @brief Largest command payload that is prefetched
+ * 
+ * Commands with a larger payload are streamed when it is their turn, the
+ * next command is then loaded after them.
+ */
+#define MACRO_PREFETCH_SIZE 128
+
+// all doc commens can be found in .c file
+
+uint8_t macro_play(struct macro_step * steps, uint8_t count, uint16_t * ir);
+
+#endif /* _MACRO_H_ */
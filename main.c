@@ -24,7 +24,12 @@
 
 #include "common.h"
 #include "ir.h"
+#include "protocol.h"
+#include "codec.h"
+#include "macro.h"
+#include "serial.h"
 #include <stdio.h>
+#include <string.h>
 
 /// currently working index (rec/replay/del)
 int8_t current_index = 0; // currently selected index
@@ -34,12 +39,435 @@ uint8_t menu = 0;
 int8_t cursor = 1;
 uint8_t line = 1;
 
+/** @brief Record a command and store it under a name
+ * 
+ * A command too long for ir is recorded again straight into the EEPROM,
+ * the button of the remote has to be pressed a second time.
+ * 
+ * @param name Name of the command
+ * @param ir Array for the timings
+ * @return 0 on success, error code otherwise
+ */
+static uint8_t record_command(char * name, uint16_t * ir) {
+  uint8_t unit;
+  uint8_t ret;
+
+  clear_array(ir, MAX_IR_EDGES);
+  ret = ir_record_command(ir, &unit);
+  if (ret == ARRAY_LIMIT_EXCEEDED) {
+    // too long for RAM: the next press is written into the EEPROM while
+    // it is recorded, ir serves as page buffer meanwhile
+    uart_sendstring_P(PSTR("Long command, press the button again\r\n"));
+    ret = eeprom_capture_open((uint8_t *)ir);
+    if (ret != MEM_SUCCESS) {
+      return ret;
+    }
+    ret = ir_record_stream(eeprom_capture_put, &unit);
+    if (ret != IR_RECORDING_SUCCESSFUL) {
+      eeprom_capture_abort();
+      return ret;
+    }
+    return eeprom_capture_close(-1, name, unit);
+  }
+  if (ret != IR_RECORDING_SUCCESSFUL) {
+    uart_sendstring_P(PSTR("IR recording failed. Error code: "));
+    uart_sendstring(i16tos(ret));
+    uart_sendstring_P(PSTR("\r\n"));
+    return ret;
+  }
+
+  return eeprom_store_command(-1, name, ir, unit);
+}
+
+/** @brief Send the macro on an index
+ * 
+ * Kept apart from replay_command (and not inlined), so the steps are only
+ * on the stack while a macro is sent.
+ * 
+ * @param index Index of the macro
+ * @param ir Array for the timings
+ * @return 0 on success, error code otherwise
+ */
+static uint8_t replay_macro(int8_t index, uint16_t * ir) __attribute__ ((noinline));
+static uint8_t replay_macro(int8_t index, uint16_t * ir) {
+  struct macro_step steps[MACRO_MAX_STEPS];
+  uint8_t count;
+
+  uint8_t ret = eeprom_load_macro(index, steps, &count);
+  if (ret != MEM_SUCCESS) {
+    return ret;
+  }
+  return macro_play(steps, count, ir);
+}
+
+/** @brief Send the command or macro on an index
+ * 
+ * Holding the select button repeats the command.
+ * 
+ * @param index Index of the command
+ * @param ir Array for the timings
+ * @return 0 on success, error code otherwise
+ */
+static uint8_t replay_command(int8_t index, uint16_t * ir) {
+  uint8_t unit;
+  uint8_t ret;
+  struct eeprom_entry entry;
+  struct protocol_code code;
+
+  // the directory entry tells how the payload has to be read, so it is
+  // only read once
+  ret = eeprom_get_entry(index, &entry);
+  if (ret != MEM_SUCCESS) {
+    return ret;
+  }
+
+  // a macro sends the commands it refers to
+  if ((entry.flags & ENTRY_FLAGS_CODEC) == CODEC_MACRO) {
+    return replay_macro(index, ir);
+  }
+
+  ir_set_carrier((entry.flags & ENTRY_FLAGS_CARRIER) >> ENTRY_FLAGS_CARRIER_SHIFT);
+
+  // a protocol code is expanded by the timer ISR, nothing to load
+  // holding the select button repeats the command at the protocol's period
+  if ((entry.flags & ENTRY_FLAGS_CODEC) == CODEC_PROTOCOL) {
+    ret = eeprom_load_protocol(index, &code, &unit);
+    if (ret != MEM_SUCCESS) {
+      return ret;
+    }
+    ret = ir_play_protocol_start(&code, unit);
+    if (ret == IR_REPLAY_SUCCESSFUL) {
+      ir_play_hold(1);
+      while (BUTTON_RIGHT) {};
+      ir_play_hold(0);
+      ir_play_wait();
+    }
+    return ret;
+  }
+
+  // stream the command from the EEPROM while it is sent
+  ret = eeprom_stream_open(index, &unit);
+  if (ret != MEM_SUCCESS) {
+    return ret;
+  }
+  ret = ir_play_stream(eeprom_stream_fill, unit);
+  uint8_t close = eeprom_stream_close();
+  if (ret == IR_REPLAY_SUCCESSFUL) {
+    ret = close;
+  }
+
+  // still held: load the command once and repeat it from RAM
+  if (ret == IR_REPLAY_SUCCESSFUL && BUTTON_RIGHT) {
+    clear_array(ir, MAX_IR_EDGES);
+    ret = eeprom_load_command(index, ir, &unit);
+    while (ret == MEM_SUCCESS && BUTTON_RIGHT) {
+      _delay_ms(IR_HOLD_GAP_MS);
+      ret = ir_play_command_start(ir, unit);
+      if (ret == IR_REPLAY_SUCCESSFUL) {
+        ir_play_wait();
+      }
+    }
+    // too long for RAM, stream it again every time
+    if (ret == MEM_RECORD_TOO_LARGE) {
+      ret = MEM_SUCCESS;
+      while (ret == MEM_SUCCESS && BUTTON_RIGHT) {
+        _delay_ms(IR_HOLD_GAP_MS);
+        ret = eeprom_stream_open(index, &unit);
+        if (ret != MEM_SUCCESS) {
+          break;
+        }
+        ret = ir_play_stream(eeprom_stream_fill, unit);
+        close = eeprom_stream_close();
+        if (ret == IR_REPLAY_SUCCESSFUL) {
+          ret = close;
+        }
+      }
+    }
+  }
+
+  return ret;
+}
+
+/** @brief Copy a name out of a request payload and terminate it */
+static void host_name(char * name, uint8_t * payload, uint8_t length) {
+  if (length > MAX_NAME_LEN - 1) {
+    length = MAX_NAME_LEN - 1;
+  }
+  memcpy(name, payload, length);
+  name[length] = 0;
+}
+
+/// error of the last failed import, the answer to the frames sent ahead
+static uint8_t import_error = MEM_SUCCESS;
+
+/** @brief Receive the payload of an import, see SERIAL_IMPORT
+ * 
+ * The frames are written into the EEPROM while the next ones arrive.
+ * A request that is no SERIAL_IMPORT_DATA stops the import and is left
+ * for host_dispatch. After an error, the SERIAL_IMPORT_DATA frames the
+ * host had already sent are answered by host_dispatch with the same
+ * error.
+ * 
+ * @param length Payload bytes of the record
+ */
+static void host_import(uint16_t length) {
+  uint16_t received = 0;
+  uint16_t idle = 0;
+  int8_t index = -1;
+
+  while (received < length) {
+    struct serial_frame * frame = serial_request();
+    if (!frame) {
+      if (++idle > SERIAL_IMPORT_TIMEOUT_MS * 10) {
+        uart_sendstring_P(PSTR("Import timed out\r\n"));
+        eeprom_capture_abort();
+        return;
+      }
+      _delay_us(100);
+      continue;
+    }
+    idle = 0;
+    if (frame->command != SERIAL_IMPORT_DATA) {
+      eeprom_capture_abort();
+      return;
+    }
+
+    uint8_t ret = eeprom_import_put(frame->payload, frame->length);
+    received += frame->length;
+    serial_done();
+    if (ret != MEM_SUCCESS) {
+      eeprom_capture_abort();
+    } else if (received >= length) {
+      ret = eeprom_import_close(&index);
+    }
+    serial_respond(SERIAL_IMPORT_DATA, ret, (uint8_t *)&index, 1);
+    if (ret != MEM_SUCCESS) {
+      import_error = ret;
+      return;
+    }
+  }
+}
+
+/** @brief Handle the request of the host and send the response
+ * 
+ * @param ir Array for the timings, keeps the uploaded timings between
+ *           SERIAL_UPLOAD and SERIAL_STORE
+ */
+static void host_dispatch(uint16_t * ir) {
+  struct serial_frame * frame = serial_request();
+  uint8_t * payload = frame->payload;
+  uint8_t length = frame->length;
+  char name[MAX_NAME_LEN];
+  uint8_t ret = SERIAL_BAD_REQUEST;
+  int8_t index = payload[0];
+
+  // the frames of a failed import are drained, this is the next request
+  if (frame->command != SERIAL_IMPORT_DATA) {
+    import_error = MEM_SUCCESS;
+  }
+
+  switch (frame->command) {
+  case SERIAL_PING: {
+    uint8_t version = SERIAL_VERSION;
+    serial_respond(frame->command, MEM_SUCCESS, &version, 1);
+    break;
+  }
+  case SERIAL_LIST: {
+    // the first stored command from the given index on, its directory
+    // entry holds name, flags and length
+    struct eeprom_entry entry;
+    uint8_t info[4];
+    ret = MEM_EMPTY_SLOT;
+    for (; length == 1 && index >= 0 && index < MAX_COMMANDS; index++) {
+      ret = eeprom_get_entry(index, &entry);
+      if (ret != MEM_EMPTY_SLOT) {
+        break;
+      }
+    }
+    if (ret != MEM_SUCCESS) {
+      serial_respond(frame->command, length == 1 ? ret : SERIAL_BAD_REQUEST, 0, 0);
+      break;
+    }
+    info[0] = index;
+    info[1] = entry.flags;
+    info[2] = entry.length & 0xff;
+    info[3] = entry.length >> 8;
+    memcpy(name, entry.name, MAX_NAME_LEN);
+    name[MAX_NAME_LEN - 1] = 0;
+    uint8_t name_length = strnlen(name, MAX_NAME_LEN);
+    serial_send_start(frame->command, MEM_SUCCESS, sizeof(info) + name_length);
+    serial_send_data(info, sizeof(info));
+    serial_send_data((uint8_t *)name, name_length);
+    serial_send_end();
+    break;
+  }
+  case SERIAL_RECORD:
+  case SERIAL_REPLAY_NAME:
+    if (length == 0) {
+      serial_respond(frame->command, SERIAL_BAD_REQUEST, 0, 0);
+      break;
+    }
+    host_name(name, payload, length);
+    if (frame->command == SERIAL_RECORD) {
+      ret = record_command(name, ir);
+      // after MEM_NAME_EXISTS the name belongs to another command
+      index = ret == MEM_SUCCESS ? eeprom_get_command_index(name) : -1;
+    } else {
+      index = eeprom_get_command_index(name);
+      ret = index < 0 ? MEM_COMMAND_NOT_FOUND : replay_command(index, ir);
+    }
+    serial_respond(frame->command, ret, (uint8_t *)&index, 1);
+    break;
+  case SERIAL_REPLAY:
+  case SERIAL_DELETE:
+    if (length == 1) {
+      ret = frame->command == SERIAL_REPLAY ? replay_command(index, ir) : eeprom_delete_command(index);
+    }
+    serial_respond(frame->command, ret, 0, 0);
+    break;
+  case SERIAL_UPLOAD: {
+    // timings go into ir from the given edge on, a new upload starts at 0
+    uint16_t first = payload[0] | (payload[1] << 8);
+    uint8_t count = (length - 2) / 2;
+    if (length < 2 || (length & 1)) {
+      serial_respond(frame->command, SERIAL_BAD_REQUEST, 0, 0);
+      break;
+    }
+    if (first == 0) {
+      clear_array(ir, MAX_IR_EDGES);
+    }
+    ret = MEM_SUCCESS;
+    if (first + count > MAX_IR_EDGES) {
+      ret = ARRAY_LIMIT_EXCEEDED;
+    } else {
+      memcpy(ir + first, payload + 2, count * 2);
+    }
+    serial_respond(frame->command, ret, 0, 0);
+    break;
+  }
+  case SERIAL_STORE:
+    index = -1;
+    if (length >= 2 && (payload[0] == IR_UNIT_16US || payload[0] == IR_UNIT_500NS)) {
+      host_name(name, payload + 1, length - 1);
+      ret = eeprom_store_command(-1, name, ir, payload[0]);
+      if (ret == MEM_SUCCESS) {
+        index = eeprom_get_command_index(name);
+      }
+    }
+    serial_respond(frame->command, ret, (uint8_t *)&index, 1);
+    break;
+  case SERIAL_MACRO: {
+    // the steps are stored straight from the request payload
+    uint8_t count = payload[0];
+    uint8_t steps_length = count * MACRO_STEP_SIZE;
+    index = -1;
+    if (length >= 2 && count <= MACRO_MAX_STEPS && length > 1 + steps_length) {
+      host_name(name, payload + 1 + steps_length, length - 1 - steps_length);
+      ret = eeprom_store_macro(-1, name, (struct macro_step *)(payload + 1), count);
+      if (ret == MEM_SUCCESS) {
+        index = eeprom_get_command_index(name);
+      }
+    }
+    serial_respond(frame->command, ret, (uint8_t *)&index, 1);
+    break;
+  }
+  case SERIAL_DOWNLOAD: {
+    uint8_t unit;
+    uint16_t first = payload[1] | (payload[2] << 8);
+    uint16_t edges = 0;
+    if (length != 3) {
+      serial_respond(frame->command, SERIAL_BAD_REQUEST, 0, 0);
+      break;
+    }
+    clear_array(ir, MAX_IR_EDGES);
+    ret = eeprom_load_command(index, ir, &unit);
+    if (ret != MEM_SUCCESS) {
+      serial_respond(frame->command, ret, 0, 0);
+      break;
+    }
+    while (edges < MAX_IR_EDGES && ir[edges]) {
+      edges++;
+    }
+    uint8_t count = 0;
+    if (first < edges) {
+      count = edges - first > SERIAL_MAX_TIMINGS ? SERIAL_MAX_TIMINGS : edges - first;
+    }
+    serial_send_start(frame->command, MEM_SUCCESS, 3 + count * 2);
+    serial_send_data(&unit, 1);
+    serial_send_data((uint8_t *)&edges, 2);
+    serial_send_data((uint8_t *)(ir + first), count * 2);
+    serial_send_end();
+    break;
+  }
+  case SERIAL_EXPORT: {
+    // all records are streamed without waiting for the host, ir serves
+    // as buffer for the payload
+    struct eeprom_entry entry;
+    uint8_t records = 0;
+    uint8_t * chunk = (uint8_t *)ir;
+    ret = length == 1 ? MEM_SUCCESS : SERIAL_BAD_REQUEST;
+    for (; length == 1 && index >= 0 && index < MAX_COMMANDS; index++) {
+      if (eeprom_get_entry(index, &entry) != MEM_SUCCESS) {
+        continue;
+      }
+      serial_send_start(SERIAL_EXPORT_RECORD, MEM_SUCCESS, 1 + ENTRY_SIZE);
+      serial_send_data((uint8_t *)&index, 1);
+      serial_send_data((uint8_t *)&entry, ENTRY_SIZE);
+      serial_send_end();
+      for (uint16_t offset = 0; offset < entry.length; offset += SERIAL_EXPORT_CHUNK) {
+        uint8_t size = entry.length - offset > SERIAL_EXPORT_CHUNK ? SERIAL_EXPORT_CHUNK : entry.length - offset;
+        ret = eeprom_read_payload(&entry, offset, chunk, size);
+        if (ret != MEM_SUCCESS) {
+          break;
+        }
+        serial_respond(SERIAL_EXPORT_DATA, MEM_SUCCESS, chunk, size);
+      }
+      if (ret != MEM_SUCCESS) {
+        break;
+      }
+      records++;
+    }
+    serial_respond(frame->command, ret, &records, 1);
+    break;
+  }
+  case SERIAL_IMPORT: {
+    // the payload follows in SERIAL_IMPORT_DATA frames, ir serves as
+    // page buffers meanwhile
+    struct eeprom_entry entry;
+    if (length == 1 + ENTRY_SIZE) {
+      memcpy(&entry, payload + 1, ENTRY_SIZE);
+      ret = eeprom_import_open(index, &entry, (uint8_t *)ir);
+    }
+    // released first, the host may send two frames once it has the response
+    serial_done();
+    serial_respond(SERIAL_IMPORT, ret, 0, 0);
+    if (ret == MEM_SUCCESS) {
+      host_import(entry.length);
+    }
+    return;
+  }
+  case SERIAL_IMPORT_DATA:
+    // sent ahead by the host before it saw that its import failed
+    index = -1;
+    serial_respond(frame->command, import_error != MEM_SUCCESS ? import_error : SERIAL_BAD_REQUEST, (uint8_t *)&index, 1);
+    break;
+  default:
+    serial_respond(frame->command, SERIAL_UNKNOWN_COMMAND, 0, 0);
+    break;
+  }
+
+  serial_done();
+}
+
 int main(void) {
   // call all setup methods
   uart_init(115200);
-  eeprom_init();
+  sei(); // the UART sends from its interrupt, even the init logs
+  if (eeprom_init() != MEM_SUCCESS) {
+    uart_sendstring_P(PSTR("Commands can not be stored\r\n"));
+  }
   ui_init();
-  sei();
+  serial_init();
 
   DDRD &= ~((1 << PD2) | (1 << PD3) | (1 << PD4) | (1 << PD5));
   PORTD |= (1 << PD2) | (1 << PD3) | (1 << PD4) | (1 << PD5);
@@ -57,17 +485,7 @@ int main(void) {
         break;
       }
 
-      // start ir recording
-      clear_array(ir_timings, MAX_IR_EDGES);
-      ret_uint = ir_record_command(ir_timings);
-      if (ret_uint != IR_RECORDING_SUCCESSFUL) {
-        uart_sendstring("IR recording failed. Error code: ");
-        uart_sendstring(i16tos(ret_uint));
-        uart_sendstring("\r\n");
-        break;
-      }
-
-      ret_uint = eeprom_store_command(-1, ir_name, ir_timings);
+      ret_uint = record_command(ir_name, ir_timings);
 
       break;
     case COMMAND_REPLAY:
@@ -77,10 +495,8 @@ int main(void) {
         // return to the main menu was requested
         break;
       }
-      clear_array(ir_timings, MAX_IR_EDGES);
-      
-      ret_uint = eeprom_load_command(current_index, ir_timings);
-      ret_uint = ir_play_command(ir_timings);
+
+      ret_uint = replay_command(current_index, ir_timings);
 
       break;
     case COMMAND_DELETE: // delete
@@ -93,9 +509,13 @@ int main(void) {
 
       ret_uint = eeprom_delete_command(current_index);
 
+      break;
+    case COMMAND_HOST:
+      // a request came in over the UART while the menu was shown
+      host_dispatch(ir_timings);
       break;
     default:
-      uart_sendstring("Unknown return code ui_get_selection\r\n");
+      uart_sendstring_P(PSTR("Unknown return code ui_get_selection\r\n"));
       break;
     }
   }
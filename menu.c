@@ -7,6 +7,7 @@
  */
 
 #include "common.h"
+#include "serial.h"
 
 int8_t digit = 0;
 char nameadd[17] = "                ";
@@ -22,7 +23,7 @@ char *DEL = "DEL";
  */
 void ui_init()
 {
-	uart_sendstring("Initializing UI\r\n");
+	uart_sendstring_P(PSTR("Initializing UI\r\n"));
 	
 	lcdSpiInit();
 	lcdInit();
@@ -51,12 +52,15 @@ int8_t ui_get_selection() // allow the link between the display part and the mai
 	//	        pos E = (0,2)          pos E = (0,7)         pos E = (0,13)
 	//	        pos C = (0,3)          pos P = (0,8)         pos L = (0,14)
 
-	uart_sendstring("Waiting for menu selection...\r\n");
+	uart_sendstring_P(PSTR("Waiting for menu selection...\r\n"));
 
 	int8_t direction = 0;
 
 	// until the button down aka "confirm selection button" is pressed, allow navigation
 	while(!(BUTTON_DOWN && (line == 1))) {
+		if(serial_pending() && line == 1) {
+			return COMMAND_HOST;
+		}
 		if((BUTTON_RIGHT || BUTTON_LEFT)&&(line == 1)){ // check which button is pressed and if we are in the main menu, that means first line 
 			if(BUTTON_RIGHT) direction=1; else direction=0; // RIGHT = 1, LEFT = 0
 			_delay_ms(200);
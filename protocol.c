@@ -0,0 +1,619 @@
+/*
+ * protocol.c
+ * 
+ * This module recognizes common IR protocols in recorded timings and
+ * generates the timings of a protocol code again.
+ */
+
+#include "protocol.h"
+#include "ir.h"
+#include <string.h>
+
+// base timings in us
+#define NEC_HEADER_MARK 9000
+#define NEC_HEADER_SPACE 4500
+#define NEC_REPEAT_SPACE 2250
+#define SAMSUNG_HEADER_MARK 4500
+#define SAMSUNG_HEADER_SPACE 4500
+#define PULSE_MARK 560          // NEC / Samsung
+#define PULSE_ZERO_SPACE 560
+#define PULSE_ONE_SPACE 1690
+#define SIRC_HEADER_MARK 2400
+#define SIRC_ONE_MARK 1200
+#define SIRC_ZERO_MARK 600
+#define SIRC_SPACE 600
+#define RC5_UNIT 889            // half bit
+#define RC5_UNITS 28            // 14 bits
+#define RC6_UNIT 444
+#define RC6_UNITS 52            // leader, start, mode, trailer, 16 bits
+#define MIN_GAP 6000            // between frames longer than the period
+
+// units of the RC6 frame parts
+#define RC6_START 8
+#define RC6_MODE 10
+#define RC6_TRAILER 16
+#define RC6_DATA 20
+
+/** @brief Duration of a recorded timing in us */
+static uint32_t protocol_us(uint16_t ticks, uint8_t unit)
+{
+	return unit == IR_UNIT_500NS ? ticks / 2 : (uint32_t)ticks * 16;
+}
+
+/** @brief Ticks of a generated duration, at least 1 (0 ends a command) */
+static uint32_t protocol_ticks(uint32_t us, uint8_t unit)
+{
+	uint32_t ticks = unit == IR_UNIT_500NS ? us * 2 : (us + 8) / 16;
+	return ticks ? ticks : 1;
+}
+
+/** @brief Check a recorded duration against a protocol timing
+ * 
+ * Receivers stretch marks and shorten spaces by up to ~100us, so a
+ * fixed margin is allowed on top of 1/4 of the timing.
+ */
+static uint8_t protocol_match(uint32_t us, uint16_t expected)
+{
+	uint32_t diff = us > expected ? us - expected : expected - us;
+	return diff <= expected / 4 + 100;
+}
+
+/** @brief Frame period of a protocol in us, repeated frames start this far apart */
+static uint32_t protocol_period(uint8_t protocol)
+{
+	switch(protocol) {
+	case PROTOCOL_SIRC:
+		return 45000;
+	case PROTOCOL_RC5:
+		return 113778;
+	case PROTOCOL_RC6:
+		return 106667;
+	default:
+		return 108000;
+	}
+}
+
+/** @brief Decode a NEC or Samsung frame
+ * 
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_pulse(uint16_t * ir, uint16_t edges, uint8_t unit, uint8_t protocol, struct protocol_code * code)
+{
+	uint16_t header_mark = protocol == PROTOCOL_NEC ? NEC_HEADER_MARK : SAMSUNG_HEADER_MARK;
+	uint16_t header_space = protocol == PROTOCOL_NEC ? NEC_HEADER_SPACE : SAMSUNG_HEADER_SPACE;
+	uint32_t data = 0;
+
+	// header, 32 bits, stop mark
+	if(edges < 67 ||
+		!protocol_match(protocol_us(ir[0], unit), header_mark) ||
+		!protocol_match(protocol_us(ir[1], unit), header_space)) {
+		return 0;
+	}
+	for(uint8_t bit = 0; bit < 32; bit++){
+		uint32_t mark = protocol_us(ir[2 + bit * 2], unit);
+		uint32_t space = protocol_us(ir[3 + bit * 2], unit);
+		if(!protocol_match(mark, PULSE_MARK)) {
+			return 0;
+		}
+		if(protocol_match(space, PULSE_ONE_SPACE)) {
+			data |= (uint32_t)1 << bit;
+		} else if(!protocol_match(space, PULSE_ZERO_SPACE)) {
+			return 0;
+		}
+	}
+	if(!protocol_match(protocol_us(ir[66], unit), PULSE_MARK)) {
+		return 0;
+	}
+
+	code->protocol = protocol;
+	code->bits = 32;
+	code->address = data & 0xFFFF;
+	code->command = data >> 16;
+	code->toggle = 0;
+	return 67;
+}
+
+/** @brief Check for a NEC repeat code (header, short space, stop mark)
+ * 
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_nec_repeat(uint16_t * ir, uint16_t edges, uint8_t unit)
+{
+	if(edges < 3 ||
+		!protocol_match(protocol_us(ir[0], unit), NEC_HEADER_MARK) ||
+		!protocol_match(protocol_us(ir[1], unit), NEC_REPEAT_SPACE) ||
+		!protocol_match(protocol_us(ir[2], unit), PULSE_MARK)) {
+		return 0;
+	}
+	return 3;
+}
+
+/** @brief Decode a Sony SIRC frame
+ * 
+ * The frame ends after the first mark that is not followed by a bit space.
+ * 
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_sirc(uint16_t * ir, uint16_t edges, uint8_t unit, struct protocol_code * code)
+{
+	uint32_t data = 0;
+	uint8_t bits = 0;
+	uint16_t i;
+
+	if(edges < 4 ||
+		!protocol_match(protocol_us(ir[0], unit), SIRC_HEADER_MARK) ||
+		!protocol_match(protocol_us(ir[1], unit), SIRC_SPACE)) {
+		return 0;
+	}
+	for(i = 2; i < edges; i += 2){
+		uint32_t mark = protocol_us(ir[i], unit);
+		if(bits == 20) {
+			return 0;
+		}
+		if(protocol_match(mark, SIRC_ONE_MARK)) {
+			data |= (uint32_t)1 << bits;
+		} else if(!protocol_match(mark, SIRC_ZERO_MARK)) {
+			return 0;
+		}
+		bits++;
+		if(i + 1 == edges || !protocol_match(protocol_us(ir[i + 1], unit), SIRC_SPACE)) {
+			break;
+		}
+	}
+	if(bits != 12 && bits != 15 && bits != 20) {
+		return 0;
+	}
+
+	code->protocol = PROTOCOL_SIRC;
+	code->bits = bits;
+	code->command = data & 0x7F;
+	code->address = data >> 7;
+	code->toggle = 0;
+	return i + 1;
+}
+
+/** @brief Split a manchester frame into units of equal length
+ * 
+ * A space longer than 4 units ends the frame, the missing units at the
+ * end are spaces.
+ * 
+ * @param levels (out) one bit per unit, 1 = mark
+ * @param count Number of units of the frame
+ * @param lead Spaces before the first mark (not recorded)
+ * @param length (out) number of timings of the frame
+ * @return 1 if all timings are whole units
+ */
+static uint8_t protocol_units(uint16_t * ir, uint16_t edges, uint8_t unit, uint16_t base,
+	uint8_t * levels, uint8_t count, uint8_t lead, uint16_t * length)
+{
+	uint8_t position = lead;
+	uint16_t i;
+
+	memset(levels, 0, (count + 7) / 8);
+	for(i = 0; i < edges; i++){
+		uint32_t us = protocol_us(ir[i], unit);
+		uint8_t mark = !(i & 1);
+		if(!mark && us > 4 * (uint32_t)base) {
+			break;
+		}
+		uint32_t units = (us + base / 2) / base;
+		uint32_t diff = us > units * base ? us - units * base : units * base - us;
+		if(units == 0 || diff > base / 3 || position + units > count) {
+			return 0;
+		}
+		while(units--) {
+			if(mark) {
+				levels[position / 8] |= 1 << (position % 8);
+			}
+			position++;
+		}
+	}
+
+	*length = i;
+	return 1;
+}
+
+/** @brief Level of a unit, see protocol_units */
+static uint8_t protocol_level(uint8_t * levels, uint8_t position)
+{
+	return (levels[position / 8] >> (position % 8)) & 1;
+}
+
+/** @brief Value of a manchester bit, 2 if the halves are equal
+ * 
+ * @param first Position of the first half
+ * @param width Units per half
+ */
+static uint8_t protocol_bit(uint8_t * levels, uint8_t first, uint8_t width)
+{
+	uint8_t a = protocol_level(levels, first);
+	uint8_t b = protocol_level(levels, first + width);
+	return a == b ? 2 : a;
+}
+
+/** @brief Decode a Philips RC5 frame
+ * 
+ * A bit is space then mark for 1, mark then space for 0. The space of the
+ * first start bit can not be recorded.
+ * 
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_rc5(uint16_t * ir, uint16_t edges, uint8_t unit, struct protocol_code * code)
+{
+	uint8_t levels[(RC5_UNITS + 7) / 8];
+	uint16_t length;
+	uint16_t word = 0;
+
+	if(!protocol_units(ir, edges, unit, RC5_UNIT, levels, RC5_UNITS, 1, &length)) {
+		return 0;
+	}
+	for(uint8_t bit = 0; bit < RC5_UNITS / 2; bit++){
+		uint8_t value = protocol_bit(levels, bit * 2, 1);
+		if(value == 2) {
+			return 0;
+		}
+		// the second half is the bit value
+		word = (word << 1) | !value;
+	}
+	// start bit
+	if(!(word & 0x2000)) {
+		return 0;
+	}
+
+	code->protocol = PROTOCOL_RC5;
+	code->bits = 14;
+	code->toggle = (word >> 11) & 1;
+	code->address = (word >> 6) & 0x1F;
+	code->command = (word & 0x3F) | (!((word >> 12) & 1) << 6);
+	return length;
+}
+
+/** @brief Decode a Philips RC6 mode 0 frame
+ * 
+ * A bit is mark then space for 1. The trailer (toggle) bit is twice as long.
+ * 
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_rc6(uint16_t * ir, uint16_t edges, uint8_t unit, struct protocol_code * code)
+{
+	uint8_t levels[(RC6_UNITS + 7) / 8];
+	uint16_t length;
+	uint16_t word = 0;
+
+	if(!protocol_units(ir, edges, unit, RC6_UNIT, levels, RC6_UNITS, 0, &length)) {
+		return 0;
+	}
+	// leader: 6 units mark, 2 units space
+	for(uint8_t i = 0; i < RC6_START; i++){
+		if(protocol_level(levels, i) != (i < 6)) {
+			return 0;
+		}
+	}
+	// start bit 1, mode 0
+	if(protocol_bit(levels, RC6_START, 1) != 1) {
+		return 0;
+	}
+	for(uint8_t i = RC6_MODE; i < RC6_TRAILER; i += 2){
+		if(protocol_bit(levels, i, 1) != 0) {
+			return 0;
+		}
+	}
+	uint8_t toggle = protocol_bit(levels, RC6_TRAILER, 2);
+	if(toggle == 2 ||
+		protocol_level(levels, RC6_TRAILER) != protocol_level(levels, RC6_TRAILER + 1) ||
+		protocol_level(levels, RC6_TRAILER + 2) != protocol_level(levels, RC6_TRAILER + 3)) {
+		return 0;
+	}
+	for(uint8_t i = RC6_DATA; i < RC6_UNITS; i += 2){
+		uint8_t value = protocol_bit(levels, i, 1);
+		if(value == 2) {
+			return 0;
+		}
+		word = (word << 1) | value;
+	}
+
+	code->protocol = PROTOCOL_RC6;
+	code->bits = 16;
+	code->toggle = toggle;
+	code->address = word >> 8;
+	code->command = word & 0xFF;
+	return length;
+}
+
+/** @brief Decode one frame of the given protocol
+ * 
+ * @param repeat 1 for the frames after the first one
+ * @return number of timings of the frame, 0 if it does not match
+ */
+static uint16_t protocol_decode_frame(uint16_t * ir, uint16_t edges, uint8_t unit, uint8_t protocol,
+	uint8_t repeat, struct protocol_code * code)
+{
+	switch(protocol) {
+	case PROTOCOL_NEC:
+		if(repeat) {
+			return protocol_decode_nec_repeat(ir, edges, unit);
+		}
+		return protocol_decode_pulse(ir, edges, unit, protocol, code);
+	case PROTOCOL_SAMSUNG:
+		return protocol_decode_pulse(ir, edges, unit, protocol, code);
+	case PROTOCOL_SIRC:
+		return protocol_decode_sirc(ir, edges, unit, code);
+	case PROTOCOL_RC5:
+		return protocol_decode_rc5(ir, edges, unit, code);
+	case PROTOCOL_RC6:
+		return protocol_decode_rc6(ir, edges, unit, code);
+	}
+	return 0;
+}
+
+/** @brief Recognize the protocol of recorded timings
+ * 
+ * The timings have to be one frame of a known protocol, optionally
+ * followed by repeated frames (NEC: repeat codes). Anything else is
+ * not recognized, so the timings are stored as they are.
+ * 
+ * @param ir Recorded timings
+ * @param edges Number of timings
+ * @param unit Tick unit of the timings
+ * @param code (out) recognized command
+ * @return 1 if recognized, 0 otherwise
+ */
+uint8_t protocol_decode(uint16_t * ir, uint16_t edges, uint8_t unit, struct protocol_code * code)
+{
+	for(uint8_t protocol = PROTOCOL_NEC; protocol <= PROTOCOL_SIRC; protocol++){
+		uint16_t position = protocol_decode_frame(ir, edges, unit, protocol, 0, code);
+		if(position == 0) {
+			continue;
+		}
+		code->repeats = 0;
+
+		// every following frame is separated by a gap and has to match
+		while(position + 1 < edges && code->repeats < 255) {
+			struct protocol_code frame = *code;
+			position++;
+			uint16_t length = protocol_decode_frame(ir + position, edges - position, unit, protocol, 1, &frame);
+			if(length == 0 || memcmp(&frame, code, sizeof(frame)) != 0) {
+				break;
+			}
+			position += length;
+			code->repeats++;
+		}
+		if(position == edges) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/** @brief Level of a unit of a generated RC5 / RC6 frame */
+static uint8_t protocol_manchester_level(struct protocol_code * code, uint8_t position)
+{
+	if(code->protocol == PROTOCOL_RC5) {
+		uint16_t word = 0x2000 | (!((code->command >> 6) & 1) << 12) | (code->toggle << 11) |
+			((code->address & 0x1F) << 6) | (code->command & 0x3F);
+		uint8_t value = (word >> (13 - position / 2)) & 1;
+		// 1 = space, mark
+		return position % 2 ? value : !value;
+	}
+
+	if(position < RC6_START) {
+		return position < 6;
+	}
+	if(position < RC6_MODE) {
+		return position == RC6_START;
+	}
+	if(position < RC6_TRAILER) {
+		// mode 0: space, mark
+		return position % 2;
+	}
+	if(position < RC6_DATA) {
+		return position < RC6_TRAILER + 2 ? code->toggle : !code->toggle;
+	}
+	uint16_t word = (code->address << 8) | (code->command & 0xFF);
+	uint8_t value = (word >> (15 - (position - RC6_DATA) / 2)) & 1;
+	// 1 = mark, space
+	return position % 2 ? !value : value;
+}
+
+/** @brief Next segment of the frame that is generated
+ * 
+ * Segments of the same level are joined by protocol_next.
+ * 
+ * @return 0 at the end of the frame
+ */
+static uint8_t protocol_segment(struct protocol_player * player, uint8_t * level, uint16_t * us)
+{
+	struct protocol_code * code = &player->code;
+	uint8_t step = player->step;
+
+	switch(code->protocol) {
+	case PROTOCOL_NEC:
+	case PROTOCOL_SAMSUNG:
+		if(step == 0) {
+			*level = 1;
+			*us = code->protocol == PROTOCOL_NEC ? NEC_HEADER_MARK : SAMSUNG_HEADER_MARK;
+		} else if(code->protocol == PROTOCOL_NEC && player->frame > 0) {
+			// repeat code
+			if(step == 1) {
+				*level = 0;
+				*us = NEC_REPEAT_SPACE;
+			} else if(step == 2) {
+				*level = 1;
+				*us = PULSE_MARK;
+			} else {
+				return 0;
+			}
+		} else if(step == 1) {
+			*level = 0;
+			*us = code->protocol == PROTOCOL_NEC ? NEC_HEADER_SPACE : SAMSUNG_HEADER_SPACE;
+		} else if(step < 66) {
+			uint8_t bit = (step - 2) / 2;
+			uint16_t word = bit < 16 ? code->address : code->command;
+			*level = !(step % 2);
+			*us = *level ? PULSE_MARK : ((word >> (bit % 16)) & 1) ? PULSE_ONE_SPACE : PULSE_ZERO_SPACE;
+		} else if(step == 66) {
+			*level = 1;
+			*us = PULSE_MARK;
+		} else {
+			return 0;
+		}
+		break;
+
+	case PROTOCOL_SIRC:
+		if(step == 0) {
+			*level = 1;
+			*us = SIRC_HEADER_MARK;
+		} else if(step < 2 + code->bits * 2) {
+			// header space, then mark and space of every bit
+			uint8_t bit = (step - 2) / 2;
+			uint32_t data = code->command | ((uint32_t)code->address << 7);
+			*level = step % 2 == 0;
+			*us = !*level ? SIRC_SPACE : ((data >> bit) & 1) ? SIRC_ONE_MARK : SIRC_ZERO_MARK;
+		} else {
+			return 0;
+		}
+		break;
+
+	case PROTOCOL_RC5:
+	case PROTOCOL_RC6: {
+		uint8_t units = code->protocol == PROTOCOL_RC5 ? RC5_UNITS : RC6_UNITS;
+		if(step >= units) {
+			return 0;
+		}
+		*level = protocol_manchester_level(code, step);
+		*us = code->protocol == PROTOCOL_RC5 ? RC5_UNIT : RC6_UNIT;
+		break;
+	}
+
+	default:
+		return 0;
+	}
+
+	player->step++;
+	return 1;
+}
+
+/** @brief Check a code that was not decoded on this remote
+ * 
+ * @param code Code of an imported record
+ * @return 1 if the timings of the code can be generated, 0 otherwise
+ */
+uint8_t protocol_code_valid(struct protocol_code * code)
+{
+	switch(code->protocol) {
+	case PROTOCOL_NEC:
+	case PROTOCOL_SAMSUNG:
+	case PROTOCOL_RC5:
+	case PROTOCOL_RC6:
+		return 1;
+	case PROTOCOL_SIRC:
+		return code->bits == 12 || code->bits == 15 || code->bits == 20;
+	default:
+		return 0;
+	}
+}
+
+/** @brief Carrier a protocol is sent with
+ * 
+ * @param protocol Protocol id (PROTOCOL_*)
+ * @return carrier profile (IR_CARRIER_*)
+ */
+uint8_t protocol_carrier(uint8_t protocol)
+{
+	switch(protocol) {
+	case PROTOCOL_RC5:
+	case PROTOCOL_RC6:
+		return IR_CARRIER_36KHZ;
+	case PROTOCOL_SIRC:
+		return IR_CARRIER_40KHZ;
+	default:
+		return IR_CARRIER_38KHZ;
+	}
+}
+
+/** @brief Start generating the timings of a command
+ * 
+ * @param player Generator state
+ * @param code Command to generate
+ * @param unit Tick unit of the generated timings
+ */
+void protocol_start(struct protocol_player * player, struct protocol_code * code, uint8_t unit)
+{
+	player->code = *code;
+	player->unit = unit;
+	player->frame = 0;
+	player->step = 0;
+	player->level = 0;
+	player->pending = 0;
+	player->elapsed = 0;
+	player->hold = 0;
+}
+
+/** @brief Generate the next timing of a command
+ * 
+ * Timings alternate between mark and space, starting with a mark.
+ * Only a few bytes of state are needed, so the timings can be generated
+ * while they are sent. While player->hold is set, repeated frames follow
+ * after code.repeats as well.
+ * 
+ * @param player Generator state, see protocol_start
+ * @return next timing in ticks, 0 at the end of the command; gaps between
+ *         frames can be longer than 16 bit in IR_UNIT_500NS
+ */
+uint32_t protocol_next_long(struct protocol_player * player)
+{
+	uint8_t level;
+	uint16_t segment;
+
+	while(1) {
+		uint32_t us;
+		if(protocol_segment(player, &level, &segment)) {
+			us = segment;
+			player->elapsed += us;
+		} else if(player->frame < player->code.repeats || player->hold) {
+			// gap until the next frame starts
+			uint32_t period = protocol_period(player->code.protocol);
+			level = 0;
+			us = player->elapsed < period ? period - player->elapsed : MIN_GAP;
+			if(player->frame < 0xFF) {
+				player->frame++;
+			}
+			player->step = 0;
+			player->elapsed = 0;
+		} else {
+			// end of the command, a space at the end is not sent
+			uint32_t last = player->level ? player->pending : 0;
+			player->pending = 0;
+			return last ? protocol_ticks(last, player->unit) : 0;
+		}
+
+		if(player->pending == 0) {
+			// nothing sent yet, the command starts with a mark
+			if(level) {
+				player->level = 1;
+				player->pending = us;
+			}
+		} else if(level == player->level) {
+			player->pending += us;
+		} else {
+			uint32_t done = player->pending;
+			player->level = level;
+			player->pending = us;
+			return protocol_ticks(done, player->unit);
+		}
+	}
+}
+
+/** @brief Generate the next timing of a command, for 16 bit arrays
+ * 
+ * Same as protocol_next_long, longer timings are cut to 0xFFFF.
+ * 
+ * @param player Generator state, see protocol_start
+ * @return next timing in ticks, 0 at the end of the command
+ */
+uint16_t protocol_next(struct protocol_player * player)
+{
+	uint32_t ticks = protocol_next_long(player);
+	return ticks > 0xFFFF ? 0xFFFF : ticks;
+}
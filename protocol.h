@@ -0,0 +1,64 @@
+/*
+ * protocol.h
+ * 
+ * This module recognizes common IR protocols in recorded timings and
+ * generates the timings of a protocol code again.
+ * 
+ * Most remotes send a short code in one of a few well known protocols.
+ * Such a command is stored as protocol, address and command (a few bytes)
+ * instead of all its timings; other commands are stored as timings.
+ */
+
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdint.h>
+
+// protocol ids, tried in this order (RC6 frames also fit the SIRC timings)
+#define PROTOCOL_NEC 1     // 32 bit pulse distance, 9ms header, repeat codes
+#define PROTOCOL_SAMSUNG 2 // 32 bit pulse distance, 4.5ms header
+#define PROTOCOL_RC5 3     // Philips, 14 bit manchester
+#define PROTOCOL_RC6 4     // Philips, mode 0, 16 bit manchester
+#define PROTOCOL_SIRC 5    // Sony, 12 / 15 / 20 bit pulse width
+
+/** @brief A recognized command
+ * 
+ * This is the payload of a CODEC_PROTOCOL record.
+ * NEC / Samsung: address = first 16 bits sent, command = last 16 bits
+ * SIRC: command = 7 bits, address = 5 / 8 / 13 bits
+ * RC5: address = 5 bits, command = 7 bits (bit 6 = inverted field bit)
+ * RC6: address = 8 bits, command = 8 bits
+ */
+struct protocol_code {
+	uint8_t protocol;
+	uint8_t bits;      // data bits of a frame
+	uint16_t address;
+	uint16_t command;
+	uint8_t toggle;    // RC5 / RC6 toggle bit
+	uint8_t repeats;   // frames sent after the first one
+};
+
+#define PROTOCOL_CODE_SIZE 8 // sizeof(struct protocol_code)
+
+/** @brief State of the timing generator, see protocol_next */
+struct protocol_player {
+	struct protocol_code code;
+	uint8_t unit;       // tick unit of the generated timings
+	uint8_t frame;      // frame that is generated
+	uint8_t step;       // next segment of the frame
+	uint8_t level;      // level of pending, 1 = mark
+	uint32_t pending;   // duration not handed out yet in us, 0 if none
+	uint32_t elapsed;   // us since the start of the frame
+	volatile uint8_t hold; // more repeated frames follow while set
+};
+
+// all doc commens can be found in .c file
+
+uint8_t protocol_decode(uint16_t * ir, uint16_t edges, uint8_t unit, struct protocol_code * code);
+uint8_t protocol_code_valid(struct protocol_code * code);
+uint8_t protocol_carrier(uint8_t protocol);
+void protocol_start(struct protocol_player * player, struct protocol_code * code, uint8_t unit);
+uint32_t protocol_next_long(struct protocol_player * player);
+uint16_t protocol_next(struct protocol_player * player);
+
+#endif /* _PROTOCOL_H_ */
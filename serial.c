@@ -0,0 +1,203 @@
+/*
+ * serial.c
+ * 
+ * This module lets a host control the remote over the UART, see serial.h
+ */
+
+#include "common.h"
+#include "serial.h"
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+// receiver states, the bytes of a frame in order
+#define RX_SOF 0
+#define RX_COMMAND 1
+#define RX_LENGTH 2
+#define RX_PAYLOAD 3
+#define RX_CRC_LOW 4
+#define RX_CRC_HIGH 5
+
+/** @brief State of the frame receiver, only used by USART_RX_vect */
+static struct {
+	struct serial_frame * frame; // frame that is received
+	uint8_t state;
+	uint8_t position;  // payload bytes received
+	uint16_t crc;
+	uint16_t received_crc;
+} rx;
+
+// received requests, oldest first; the ISR fills the slot behind the
+// waiting ones and does not touch a waiting one until serial_done
+static struct serial_frame requests[SERIAL_RX_FRAMES];
+static volatile uint8_t request_first = 0;
+static volatile uint8_t request_count = 0;
+
+// CRC of the response that is sent
+static uint16_t tx_crc;
+
+volatile uint16_t serial_crc_errors = 0;
+
+/** @brief Start receiving requests
+ * 
+ * uart_init has to be called before.
+ */
+void serial_init()
+{
+	rx.state = RX_SOF;
+	request_first = 0;
+	request_count = 0;
+	UCSR0B |= (1<<RXCIE0);
+}
+
+/** @brief Check if a request is waiting
+ * 
+ * @return 1 if serial_request returns a frame, 0 otherwise
+ */
+uint8_t serial_pending()
+{
+	return request_count != 0;
+}
+
+/** @brief Get the oldest received request
+ * 
+ * The frame stays valid until serial_done.
+ * 
+ * @return the request, 0 if none is waiting
+ */
+struct serial_frame * serial_request()
+{
+	return request_count ? &requests[request_first] : 0;
+}
+
+/** @brief Release the oldest request, its slot can be received into again */
+void serial_done()
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if(request_count) {
+			request_first = (request_first + 1) % SERIAL_RX_FRAMES;
+			request_count--;
+		}
+	}
+}
+
+/** @brief Queue a byte of the response and add it to the CRC */
+static void serial_send_byte(uint8_t byte)
+{
+	tx_crc = _crc_ccitt_update(tx_crc, byte);
+	uart_transmit(byte);
+}
+
+/** @brief Start a response
+ * 
+ * Has to be followed by serial_send_data calls with length bytes in total
+ * and serial_send_end.
+ * 
+ * @param command Command of the request
+ * @param status 0 on success, error code otherwise
+ * @param length Payload bytes after the status
+ */
+void serial_send_start(uint8_t command, uint8_t status, uint8_t length)
+{
+	uart_frame_open = 1;
+	uart_transmit(SERIAL_SOF);
+	tx_crc = 0xFFFF;
+	serial_send_byte(command | SERIAL_RESPONSE);
+	serial_send_byte(length + 1);
+	serial_send_byte(status);
+}
+
+/** @brief Send payload bytes of a response */
+void serial_send_data(uint8_t * data, uint8_t length)
+{
+	for(uint8_t i = 0; i < length; i++){
+		serial_send_byte(data[i]);
+	}
+}
+
+/** @brief Finish a response with its CRC */
+void serial_send_end()
+{
+	uint16_t crc = tx_crc;
+	uart_transmit(crc & 0xff);
+	uart_transmit(crc >> 8);
+	uart_frame_open = 0;
+}
+
+/** @brief Send a whole response
+ * 
+ * @param command Command of the request
+ * @param status 0 on success, error code otherwise
+ * @param data Payload after the status, may be 0 if length is 0
+ * @param length Number of bytes in data
+ */
+void serial_respond(uint8_t command, uint8_t status, uint8_t * data, uint8_t length)
+{
+	serial_send_start(command, status, length);
+	serial_send_data(data, length);
+	serial_send_end();
+}
+
+/**
+ * @brief ISR called for every received byte, assembles the request
+ * 
+ * A frame with a wrong CRC is dropped, the host repeats it after its
+ * timeout. The receiver then looks for the next SERIAL_SOF.
+ */
+ISR(USART_RX_vect)
+{
+	uint8_t byte = UDR0;
+
+	switch(rx.state)
+	{
+	case RX_SOF:
+		// with all slots waiting the frame is dropped, the host has to
+		// wait for a response first
+		if(byte == SERIAL_SOF && request_count < SERIAL_RX_FRAMES)
+		{
+			rx.frame = &requests[(request_first + request_count) % SERIAL_RX_FRAMES];
+			rx.crc = 0xFFFF;
+			rx.state = RX_COMMAND;
+		}
+		return;
+	case RX_COMMAND:
+		rx.frame->command = byte;
+		rx.state = RX_LENGTH;
+		break;
+	case RX_LENGTH:
+		if(byte > SERIAL_MAX_PAYLOAD)
+		{
+			rx.state = RX_SOF;
+			return;
+		}
+		rx.frame->length = byte;
+		rx.position = 0;
+		rx.state = byte ? RX_PAYLOAD : RX_CRC_LOW;
+		break;
+	case RX_PAYLOAD:
+		rx.frame->payload[rx.position++] = byte;
+		if(rx.position == rx.frame->length)
+		{
+			rx.state = RX_CRC_LOW;
+		}
+		break;
+	case RX_CRC_LOW:
+		rx.received_crc = byte;
+		rx.state = RX_CRC_HIGH;
+		return;
+	case RX_CRC_HIGH:
+		rx.received_crc |= byte << 8;
+		rx.state = RX_SOF;
+		if(rx.received_crc == rx.crc)
+		{
+			request_count++;
+		}
+		else
+		{
+			serial_crc_errors++;
+		}
+		return;
+	}
+
+	rx.crc = _crc_ccitt_update(rx.crc, byte);
+}
@@ -0,0 +1,105 @@
+/*
+ * serial.h
+ * 
+ * This module lets a host control the remote over the UART: list, record,
+ * replay and delete commands and move timings in both directions.
+ * 
+ * Requests and responses are frames:
+ *   SERIAL_SOF, command, payload length, payload, CRC-16 (low byte first)
+ * The CRC (CCITT, start value 0xFFFF, see _crc_ccitt_update) covers
+ * command, length and payload. The host sends one request and waits for
+ * its response. A response has the command of the request with
+ * SERIAL_RESPONSE set, its first payload byte is the status (0 = success,
+ * else the error code of the failed function). The log text is sent in
+ * between the frames and never contains SERIAL_SOF; text logged while a
+ * frame is sent (e.g. by an ISR) is dropped.
+ * 
+ * tools/remote.py is a host client for this protocol.
+ */
+
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include <stdint.h>
+
+#define SERIAL_SOF 0xA5
+#define SERIAL_RESPONSE 0x80
+#define SERIAL_VERSION 1
+
+/** @brief Max. payload bytes of a request */
+#define SERIAL_MAX_PAYLOAD 64
+
+/** @brief Number of requests that are buffered
+ * 
+ * A frame that arrives while all of them wait to be handled is dropped.
+ * The host may send this many SERIAL_IMPORT_DATA frames ahead of their
+ * responses, other requests one at a time.
+ */
+#define SERIAL_RX_FRAMES 2
+
+// commands: request payload -> response payload after the status
+#define SERIAL_PING 0x01        // - -> SERIAL_VERSION
+#define SERIAL_LIST 0x02        // first index -> index, flags, length (uint16), name
+#define SERIAL_RECORD 0x03      // name -> index
+#define SERIAL_REPLAY 0x04      // index -> -
+#define SERIAL_REPLAY_NAME 0x05 // name -> index
+#define SERIAL_DELETE 0x06      // index -> -
+#define SERIAL_UPLOAD 0x07      // first edge (uint16), timings (uint16) -> -
+#define SERIAL_STORE 0x08       // unit, name -> index
+#define SERIAL_DOWNLOAD 0x09    // index, first edge (uint16) -> unit, edges (uint16), timings (uint16)
+#define SERIAL_EXPORT 0x0A      // first index -> number of exported records, see below
+#define SERIAL_EXPORT_RECORD 0x0B // response only: index, struct eeprom_entry
+#define SERIAL_EXPORT_DATA 0x0C // response only: payload bytes
+#define SERIAL_IMPORT 0x0D      // index (-1 = any), struct eeprom_entry -> index
+#define SERIAL_IMPORT_DATA 0x0E // payload bytes -> - (index after the last one)
+#define SERIAL_MACRO 0x0F       // step count, steps (struct macro_step), name -> index
+
+/* Export: every stored record from the first index on is sent as one
+ * SERIAL_EXPORT_RECORD frame followed by SERIAL_EXPORT_DATA frames with
+ * SERIAL_EXPORT_CHUNK payload bytes each (the last one may be shorter),
+ * without waiting for the host. The SERIAL_EXPORT response ends the
+ * export. The checksum in the entry is the CRC-8 of the payload.
+ * 
+ * Import: after the SERIAL_IMPORT response the payload follows in
+ * SERIAL_IMPORT_DATA frames (up to SERIAL_MAX_PAYLOAD bytes each). Each
+ * one is answered when its bytes are handed to the page writes, the
+ * answer to the last one tells if the record was stored. The import is
+ * stopped by an error, another request or SERIAL_IMPORT_TIMEOUT_MS
+ * without a frame. Frames the host sent ahead of an error get that error
+ * as their answer too.
+ * 
+ * Macro: the steps refer to stored commands by index, the payload limit
+ * leaves room for up to 15 steps.
+ */
+#define SERIAL_EXPORT_CHUNK 64
+#define SERIAL_IMPORT_TIMEOUT_MS 2000
+
+// all multi byte values are sent low byte first
+#define SERIAL_MAX_TIMINGS 30 // timings in one SERIAL_DOWNLOAD response
+
+// status codes of the protocol itself
+#define SERIAL_BAD_REQUEST 0xFE     // payload does not fit the command
+#define SERIAL_UNKNOWN_COMMAND 0xFF
+
+/** @brief A received request */
+struct serial_frame {
+	uint8_t command;
+	uint8_t length;
+	uint8_t payload[SERIAL_MAX_PAYLOAD];
+};
+
+// frames dropped because of a wrong CRC, since reset
+extern volatile uint16_t serial_crc_errors;
+
+// all doc commens can be found in .c file
+
+void serial_init();
+uint8_t serial_pending();
+struct serial_frame * serial_request();
+void serial_done();
+void serial_send_start(uint8_t command, uint8_t status, uint8_t length);
+void serial_send_data(uint8_t * data, uint8_t length);
+void serial_send_end();
+void serial_respond(uint8_t command, uint8_t status, uint8_t * data, uint8_t length);
+
+#endif /* _SERIAL_H_ */
@@ -0,0 +1,220 @@
+/*
+ * codec_bench.c
+ *
+ * Host benchmark of the timing codecs (codec.c). Every file given on the
+ * command line holds the timings of one command, in the format printed by
+ * `remote.py download`: a "unit" line and the timings separated by commas
+ * or white space. Lines starting with # are comments.
+ *
+ * For every command the encoded size of each codec, the codec that
+ * codec_choose picks and the time codec_decode takes on the host are
+ * printed. Build and run it with `make bench`.
+ *
+ * Commands that codec_find_repeat takes as a repeated frame are also
+ * stored as CODEC_REPEAT, the way eeprom_store_command does it. The record
+ * has to decode to the first frame and gap sent again and again, and every
+ * timing has to stay within the codec tolerance of the capture. Captures
+ * of a held button (files named held_*) have to be found and must get
+ * smaller. The program exits with 1 if a check fails.
+ */
+
+#include "../codec.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_EDGES 1024
+#define BENCH_DECODE_RUNS 20000
+
+static const uint8_t bench_codecs[] = {CODEC_RAW, CODEC_DELTA, CODEC_SYMBOL, CODEC_BYTE};
+static const char * const bench_codec_names[] = {"raw", "delta", "symbol", "protocol", "macro", "byte", "repeat"};
+
+/** @brief Collects the bytes of codec_encode */
+struct bench_buffer {
+	uint8_t bytes[BENCH_MAX_EDGES * 3];
+	uint16_t length;
+};
+
+static void bench_emit(uint8_t byte, void * context)
+{
+	struct bench_buffer * buffer = context;
+	buffer->bytes[buffer->length++] = byte;
+}
+
+/** @brief Read the timings of one command
+ *
+ * @return number of timings, 0 if the file can not be read
+ */
+static uint16_t bench_read(const char * path, uint16_t * ir)
+{
+	FILE * file = fopen(path, "r");
+	char line[512];
+	uint16_t edges = 0;
+
+	if(!file){
+		perror(path);
+		return 0;
+	}
+	while(fgets(line, sizeof(line), file)){
+		if(line[0] == '#' || strncmp(line, "unit", 4) == 0){
+			continue;
+		}
+		for(char * p = line; *p; ){
+			if(!isdigit((unsigned char)*p)){
+				p++;
+				continue;
+			}
+			unsigned long timing = strtoul(p, &p, 10);
+			if(timing == 0 || timing > 0xFFFF || edges == BENCH_MAX_EDGES){
+				fprintf(stderr, "%s: timing %lu out of range\n", path, timing);
+				fclose(file);
+				return 0;
+			}
+			ir[edges++] = timing;
+		}
+	}
+	fclose(file);
+	return edges;
+}
+
+/** @brief Same bound as codec_in_tolerance in codec.c */
+static uint8_t bench_in_tolerance(uint16_t value, uint16_t center)
+{
+	uint16_t diff = value > center ? value - center : center - value;
+	return diff <= center / 8 + 2;
+}
+
+/** @brief Host time of one codec_decode call in ns */
+static double bench_decode_ns(uint8_t codec, struct bench_buffer * payload, uint16_t * ir)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(uint32_t i = 0; i < BENCH_DECODE_RUNS; i++){
+		codec_decode(codec, payload->bytes, payload->length, ir, BENCH_MAX_EDGES);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / BENCH_DECODE_RUNS;
+}
+
+/** @brief Print the sizes and decode time of one command
+ *
+ * @return bytes of the chosen codec
+ */
+static uint16_t bench_command(const char * path, uint16_t * ir, uint16_t edges)
+{
+	static uint16_t decoded[BENCH_MAX_EDGES];
+	static struct bench_buffer payload;
+	uint8_t chosen = codec_choose(ir, edges, 0);
+	uint16_t raw = codec_encode(CODEC_RAW, ir, edges, 0, 0);
+	const char * name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	printf("%-20s %5u", name, edges);
+	for(uint8_t i = 0; i < sizeof(bench_codecs); i++){
+		uint16_t length = codec_encode(bench_codecs[i], ir, edges, 0, 0);
+		if(length == 0){
+			printf("  %6s", "-");
+		}else{
+			printf("  %6u", length);
+		}
+	}
+
+	payload.length = 0;
+	codec_encode(chosen, ir, edges, bench_emit, &payload);
+	if(codec_decode(chosen, payload.bytes, payload.length, decoded, BENCH_MAX_EDGES) != edges){
+		printf("\n%s: %s does not decode to %u edges\n", name, bench_codec_names[chosen], edges);
+		exit(1);
+	}
+	printf("  %-6s %5.2f  %8.0f\n", bench_codec_names[chosen], (double)raw / payload.length,
+		bench_decode_ns(chosen, &payload, decoded));
+
+	return payload.length;
+}
+
+/** @brief Store a command as CODEC_REPEAT and check the record
+ *
+ * @return 0 if the checks pass, 1 otherwise
+ */
+static uint8_t bench_repeat(const char * path, uint16_t * ir, uint16_t edges)
+{
+	static uint16_t decoded[BENCH_MAX_EDGES];
+	static struct bench_buffer payload;
+	struct codec_repeat repeat;
+	const char * name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	uint8_t held = strncmp(name, "held_", 5) == 0;
+	uint16_t plain = codec_encode(codec_choose(ir, edges, 0), ir, edges, 0, 0);
+	uint16_t frame = codec_find_repeat(ir, edges, &repeat);
+
+	if(frame == 0){
+		if(held){
+			printf("%-20s %5u  no repeated frame found\n", name, edges);
+			return 1;
+		}
+		return 0;
+	}
+
+	// as in eeprom_store_command: header, then the frame lossless
+	repeat.codec = codec_choose(ir, frame, 1);
+	memcpy(payload.bytes, &repeat, CODEC_REPEAT_SIZE);
+	payload.length = CODEC_REPEAT_SIZE;
+	codec_encode(repeat.codec, ir, frame, bench_emit, &payload);
+
+	uint16_t count = codec_decode(CODEC_REPEAT, payload.bytes, payload.length, decoded, BENCH_MAX_EDGES);
+	uint16_t error = 0;
+	uint8_t identical = count == edges;
+	uint8_t failed = count != edges || (held && payload.length >= plain);
+	for(uint16_t i = 0; i < count && i < edges; i++){
+		uint16_t diff = decoded[i] > ir[i] ? decoded[i] - ir[i] : ir[i] - decoded[i];
+		error = diff > error ? diff : error;
+		identical &= diff == 0;
+		// every frame and gap is sent as the first one
+		failed |= decoded[i] != ir[i % (frame + 1)] || !bench_in_tolerance(ir[i], decoded[i]);
+	}
+
+	printf("%-20s %5u  %2u x %3u edges  %4u -> %4u bytes  %s", name, edges,
+		repeat.repeats + 1, frame, plain, payload.length, bench_codec_names[repeat.codec]);
+	if(identical){
+		printf("  identical");
+	}else{
+		printf("  max error %u ticks", error);
+	}
+	printf("%s\n", failed ? "  FAILED" : "");
+
+	return failed;
+}
+
+int main(int argc, char ** argv)
+{
+	static uint16_t ir[BENCH_MAX_EDGES];
+	uint32_t raw_total = 0;
+	uint32_t chosen_total = 0;
+	uint8_t failed = 0;
+
+	if(argc < 2){
+		fprintf(stderr, "usage: %s TIMINGS...\n", argv[0]);
+		return 2;
+	}
+
+	printf("%-20s %5s  %6s  %6s  %6s  %6s  %-6s %5s  %8s\n", "command", "edges",
+		"raw", "delta", "symbol", "byte", "chosen", "ratio", "decode ns");
+	for(int i = 1; i < argc; i++){
+		uint16_t edges = bench_read(argv[i], ir);
+		if(edges == 0){
+			return 1;
+		}
+		raw_total += codec_encode(CODEC_RAW, ir, edges, 0, 0);
+		chosen_total += bench_command(argv[i], ir, edges);
+	}
+	printf("total %u -> %u bytes, ratio %.2f\n", raw_total, chosen_total, (double)raw_total / chosen_total);
+
+	printf("\n%-20s %5s  %-14s  %-19s  %s\n", "repeated frames", "edges", "frames", "plain -> repeat", "frame codec");
+	for(int i = 1; i < argc; i++){
+		uint16_t edges = bench_read(argv[i], ir);
+		failed |= bench_repeat(argv[i], ir, edges);
+	}
+
+	return failed;
+}
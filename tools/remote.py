@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""Host client for the serial control protocol of the remote (see serial.h).
+
+Examples:
+    remote.py ping
+    remote.py list
+    remote.py record tv_on
+    remote.py replay tv_on        (index or name)
+    remote.py delete 3
+    remote.py upload amp timings.txt --unit 16us
+    remote.py download 3
+    remote.py macro movie tv_on:0:500 hdmi2 vol_up:4:100   (command:repeats:delay ms)
+    remote.py bench --count 50
+    remote.py export library.bin
+    remote.py import library.bin
+
+Needs pyserial. The device logs plain text on the same port, everything
+outside of a frame is printed with --verbose and skipped otherwise.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+SOF = 0xA5
+RESPONSE = 0x80
+
+PING = 0x01
+LIST = 0x02
+RECORD = 0x03
+REPLAY = 0x04
+REPLAY_NAME = 0x05
+DELETE = 0x06
+UPLOAD = 0x07
+STORE = 0x08
+DOWNLOAD = 0x09
+EXPORT = 0x0A
+EXPORT_RECORD = 0x0B
+EXPORT_DATA = 0x0C
+IMPORT = 0x0D
+IMPORT_DATA = 0x0E
+MACRO = 0x0F
+
+MAX_PAYLOAD = 64
+MAX_TIMINGS = 30
+RX_FRAMES = 2  # import frames the device buffers
+ENTRY = struct.Struct("<10sHHBB")  # struct eeprom_entry
+STEP = struct.Struct("<bBH")  # struct macro_step
+MACRO_MAX_REPEATS = 100
+UNITS = {"16us": 0, "500ns": 1}
+
+CODECS = ["raw", "delta", "symbol", "protocol", "macro", "byte", "repeat"]
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16 CCITT as _crc_ccitt_update of avr-libc."""
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+
+def crc8(data):
+    """CRC-8 of a record payload as _crc8_ccitt_update of avr-libc."""
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class Remote:
+    def __init__(self, port, baudrate=115200, verbose=False):
+        self.port = serial.Serial(port, baudrate, timeout=0.1)
+        self.verbose = verbose
+        self.log = bytearray()
+
+    def _read(self, size, deadline):
+        data = bytearray()
+        while len(data) < size:
+            if time.monotonic() > deadline:
+                raise ProtocolError("timeout")
+            data += self.port.read(size - len(data))
+        return data
+
+    def _log_byte(self, byte):
+        if byte == 0x0A:
+            if self.verbose:
+                print("device:", self.log.decode(errors="replace").strip(), file=sys.stderr)
+            self.log.clear()
+        else:
+            self.log.append(byte)
+
+    def receive(self, timeout):
+        """Next frame from the device, return (command, status, payload)."""
+        deadline = time.monotonic() + timeout
+        while True:
+            byte = self._read(1, deadline)[0]
+            if byte != SOF:
+                self._log_byte(byte)
+                continue
+            header = self._read(2, deadline)
+            payload = self._read(header[1], deadline)
+            crc = struct.unpack("<H", self._read(2, deadline))[0]
+            if crc != crc16(header + payload) or not header[0] & RESPONSE or not payload:
+                # not a frame after all, look for the next one
+                continue
+            return header[0] & ~RESPONSE, payload[0], bytes(payload[1:])
+
+    def _receive(self, command, timeout):
+        while True:
+            received, status, data = self.receive(timeout)
+            if received == command:
+                return status, data
+
+    def send(self, command, payload=b""):
+        if len(payload) > MAX_PAYLOAD:
+            raise ValueError("payload too long")
+        frame = bytes([command, len(payload)]) + bytes(payload)
+        self.port.write(bytes([SOF]) + frame + struct.pack("<H", crc16(frame)))
+
+    def request(self, command, payload=b"", timeout=2.0, retries=3):
+        """Send a request, return (status, payload after the status)."""
+        for attempt in range(retries):
+            self.send(command, payload)
+            try:
+                return self._receive(command, timeout)
+            except ProtocolError:
+                if attempt == retries - 1:
+                    raise
+
+    def check(self, command, payload=b"", timeout=2.0):
+        status, data = self.request(command, payload, timeout)
+        if status != 0:
+            raise ProtocolError("command 0x%02x failed with status %d" % (command, status))
+        return data
+
+    def index_of(self, target):
+        """Index of a command given by index or name."""
+        if target.isdigit():
+            return int(target)
+        for index, _, _, name in self.entries():
+            if name == target:
+                return index
+        raise ProtocolError("no command named %r" % target)
+
+    def entries(self):
+        index = 0
+        while True:
+            status, data = self.request(LIST, bytes([index]))
+            if status != 0:
+                return
+            index, flags, length = struct.unpack("<BBH", data[:4])
+            yield index, flags, length, data[4:].decode(errors="replace")
+            index += 1
+
+    def export(self):
+        """All stored records as (index, entry bytes, payload)."""
+        self.send(EXPORT, bytes([0]))
+        records = []
+        while True:
+            command, status, data = self.receive(5.0)
+            if status != 0:
+                raise ProtocolError("export failed with status %d" % status)
+            if command == EXPORT_RECORD:
+                records.append((data[0], data[1:1 + ENTRY.size], bytearray()))
+            elif command == EXPORT_DATA:
+                records[-1][2].extend(data)
+            elif command == EXPORT:
+                break
+        for index, entry, payload in records:
+            name, _, length, _, checksum = ENTRY.unpack(entry)
+            if len(payload) != length or crc8(payload) != checksum:
+                raise ProtocolError("record %d (%s) is damaged" % (index, name.rstrip(b"\0").decode()))
+        if len(records) != data[0]:
+            raise ProtocolError("%d records announced, %d received" % (data[0], len(records)))
+        return records
+
+    def import_record(self, index, entry, payload):
+        """Store an exported record, return its new index."""
+        self.check(IMPORT, struct.pack("<b", index) + entry)
+        chunks = [payload[i:i + MAX_PAYLOAD] for i in range(0, len(payload), MAX_PAYLOAD)]
+        sent = 0
+        for acked in range(len(chunks)):
+            # keep the device's receive buffers busy
+            while sent < len(chunks) and sent < acked + RX_FRAMES:
+                self.send(IMPORT_DATA, chunks[sent])
+                sent += 1
+            status, data = self._receive(IMPORT_DATA, 5.0)
+            if status != 0:
+                raise ProtocolError("import of record %d failed with status %d" % (index, status))
+        return struct.unpack("<b", data[:1])[0]
+
+    def upload(self, timings):
+        for first in range(0, len(timings), MAX_TIMINGS):
+            chunk = timings[first:first + MAX_TIMINGS]
+            self.check(UPLOAD, struct.pack("<H%dH" % len(chunk), first, *chunk))
+
+    def download(self, index):
+        timings = []
+        while True:
+            data = self.check(DOWNLOAD, struct.pack("<bH", index, len(timings)))
+            unit, edges = struct.unpack("<BH", data[:3])
+            chunk = struct.unpack("<%dH" % ((len(data) - 3) // 2), data[3:])
+            timings += chunk
+            if not chunk or len(timings) >= edges:
+                return unit, timings
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", default="/dev/ttyACM0")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("-v", "--verbose", action="store_true", help="print the log of the device")
+    commands = parser.add_subparsers(dest="command", required=True)
+    commands.add_parser("ping")
+    commands.add_parser("list")
+    commands.add_parser("record").add_argument("name")
+    commands.add_parser("replay").add_argument("target", help="index or name")
+    commands.add_parser("delete").add_argument("target", help="index or name")
+    upload = commands.add_parser("upload", help="store timings from a file (numbers separated by whitespace or commas)")
+    upload.add_argument("name")
+    upload.add_argument("file")
+    upload.add_argument("--unit", choices=UNITS, default="16us")
+    commands.add_parser("download").add_argument("target", help="index or name")
+    macro = commands.add_parser("macro", help="store a macro that sends stored commands one after the other")
+    macro.add_argument("name")
+    macro.add_argument("steps", nargs="+", help="command[:repeats[:delay ms]], the command as index or name")
+    bench = commands.add_parser("bench", help="measure round trips and download throughput")
+    bench.add_argument("--count", type=int, default=20)
+    bench.add_argument("--target", help="command to download, the first stored one if not given")
+    commands.add_parser("export", help="save all records into a file").add_argument("file")
+    restore = commands.add_parser("import", help="store the records of an exported file")
+    restore.add_argument("file")
+    restore.add_argument("--any-index", action="store_true", help="use the first empty slots instead of the exported indices (breaks macros)")
+    args = parser.parse_args()
+
+    remote = Remote(args.port, args.baud, args.verbose)
+
+    if args.command == "ping":
+        print("protocol version", remote.check(PING)[0])
+    elif args.command == "list":
+        for index, flags, length, name in remote.entries():
+            codec = CODECS[flags & 0x07] if flags & 0x07 < len(CODECS) else flags & 0x07
+            print("%3d  %-10s %-8s %5d bytes" % (index, name, codec, length))
+    elif args.command == "record":
+        print("press the button of the remote...")
+        index = remote.check(RECORD, args.name.encode(), timeout=30.0)[0]
+        print("stored at", index)
+    elif args.command == "replay":
+        if args.target.isdigit():
+            remote.check(REPLAY, bytes([int(args.target)]), timeout=10.0)
+        else:
+            remote.check(REPLAY_NAME, args.target.encode(), timeout=10.0)
+    elif args.command == "delete":
+        remote.check(DELETE, bytes([remote.index_of(args.target)]))
+    elif args.command == "upload":
+        with open(args.file) as f:
+            timings = [int(t) for t in f.read().replace(",", " ").split()]
+        remote.upload(timings)
+        index = remote.check(STORE, bytes([UNITS[args.unit]]) + args.name.encode())[0]
+        print("stored at", index)
+    elif args.command == "download":
+        unit, timings = remote.download(remote.index_of(args.target))
+        print("unit", [u for u, v in UNITS.items() if v == unit][0])
+        print(", ".join(str(t) for t in timings))
+    elif args.command == "macro":
+        steps = b""
+        for step in args.steps:
+            target, repeats, delay = (step.split(":") + ["0", "0"])[:3]
+            if not 0 <= int(repeats) <= MACRO_MAX_REPEATS:
+                sys.exit("error: %s repeats more than %d times" % (target, MACRO_MAX_REPEATS))
+            steps += STEP.pack(remote.index_of(target), int(repeats), int(delay))
+        payload = bytes([len(args.steps)]) + steps + args.name.encode()
+        if len(payload) > MAX_PAYLOAD:
+            sys.exit("error: too many steps for one request")
+        print("stored at", remote.check(MACRO, payload)[0])
+    elif args.command == "export":
+        start = time.monotonic()
+        records = remote.export()
+        size = 0
+        with open(args.file, "wb") as f:
+            for index, entry, payload in records:
+                f.write(bytes([index]) + entry + payload)
+                size += len(payload)
+        elapsed = time.monotonic() - start
+        print("%d records, %d bytes in %.1f s (%.0f bytes/s)" % (len(records), size, elapsed, size / elapsed))
+    elif args.command == "import":
+        with open(args.file, "rb") as f:
+            image = f.read()
+        start = time.monotonic()
+        position = size = count = 0
+        while position < len(image):
+            index = image[position]
+            entry = image[position + 1:position + 1 + ENTRY.size]
+            length = ENTRY.unpack(entry)[2]
+            payload = image[position + 1 + ENTRY.size:position + 1 + ENTRY.size + length]
+            position += 1 + ENTRY.size + length
+            remote.import_record(-1 if args.any_index else index, entry, payload)
+            size += length
+            count += 1
+        elapsed = time.monotonic() - start
+        print("%d records, %d bytes in %.1f s (%.0f bytes/s)" % (count, size, elapsed, size / elapsed))
+    elif args.command == "bench":
+        start = time.monotonic()
+        for _ in range(args.count):
+            remote.check(PING)
+        elapsed = time.monotonic() - start
+        print("ping: %.1f ms per round trip" % (elapsed / args.count * 1000))
+
+        index = remote.index_of(args.target) if args.target else next(remote.entries())[0]
+        start = time.monotonic()
+        edges = 0
+        for _ in range(args.count):
+            edges += len(remote.download(index)[1])
+        elapsed = time.monotonic() - start
+        print("download: %.0f timings/s, %.0f bytes/s" % (edges / elapsed, edges * 2 / elapsed))
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except ProtocolError as error:
+        sys.exit("error: %s" % error)